@@ -0,0 +1,75 @@
+; Recursive Fibonacci, used to measure JSR/RET and stack traffic.
+; Computes fib(23) 40 times (~39M instructions) with a stack in R6 and
+; prints the result (28657).
+        .ORIG x3000
+        LD R6, STACK
+        LD R5, REPEAT
+AGAIN   LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp AGAIN
+        JSR PRDEC
+        HALT
+STACK   .FILL xFD00
+REPEAT  .FILL #40
+N       .FILL #23
+
+; R0 = fib(R0), uses R1, R6 (stack)
+FIB     ADD R1, R0, #-2
+        BRn FIBRET              ; fib(0) = 0, fib(1) = 1
+        ADD R6, R6, #-1
+        STR R7, R6, #0          ; push the return address
+        ADD R6, R6, #-1
+        STR R0, R6, #0          ; push n
+        ADD R0, R0, #-1
+        JSR FIB                 ; fib(n - 1)
+        LDR R1, R6, #0
+        STR R0, R6, #0          ; replace n by fib(n - 1)
+        ADD R0, R1, #-2
+        JSR FIB                 ; fib(n - 2)
+        LDR R1, R6, #0
+        ADD R0, R0, R1
+        ADD R6, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+FIBRET  RET
+
+; prints R0 (0 - 32767) in decimal followed by a newline, uses R0-R5
+PRDEC   ST R7, PDR7
+        LEA R3, PDTAB
+        AND R4, R4, #0          ; != 0 once a digit has been printed
+PDNEXT  LDR R2, R3, #0          ; -(10^k), 0 ends the table
+        BRz PDLAST
+        AND R1, R1, #0          ; digit
+PDSUB   ADD R5, R0, R2
+        BRn PDDIG
+        ADD R0, R5, #0
+        ADD R1, R1, #1
+        BRnzp PDSUB
+PDDIG   ADD R3, R3, #1
+        ADD R5, R1, R4          ; skip the leading zeros
+        BRz PDNEXT
+        ADD R4, R4, #1
+        ST R0, PDR0
+        LD R0, PDASC
+        ADD R0, R0, R1
+        OUT
+        LD R0, PDR0
+        BRnzp PDNEXT
+PDLAST  LD R1, PDASC
+        ADD R0, R0, R1
+        OUT
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PDR7
+        RET
+PDR7    .FILL 0
+PDR0    .FILL 0
+PDASC   .FILL x30
+PDTAB   .FILL #-10000
+        .FILL #-1000
+        .FILL #-100
+        .FILL #-10
+        .FILL 0
+        .END
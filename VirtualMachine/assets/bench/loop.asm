@@ -0,0 +1,19 @@
+; Tight arithmetic loop used to measure the dispatch overhead of the VM.
+; Runs 2000 * 10000 iterations of a 4 instruction loop body (~80M instructions)
+; and prints "done" before halting.
+        .ORIG x3000
+        LD R1, COUNT
+OUTER   LD R2, INNER
+LOOP    ADD R3, R3, #1
+        AND R4, R3, #7
+        ADD R2, R2, #-1
+        BRp LOOP
+        ADD R1, R1, #-1
+        BRp OUTER
+        LEA R0, MSG
+        PUTS
+        HALT
+COUNT   .FILL #2000
+INNER   .FILL #10000
+MSG     .STRINGZ "done\n"
+        .END
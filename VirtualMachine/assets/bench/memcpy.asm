@@ -0,0 +1,46 @@
+; Word by word memory copy, used to measure loads/stores.
+; Copies a 4096 word buffer (x4000) to x6000 2000 times (~49M instructions),
+; then checks the last copied word and prints "done".
+        .ORIG x3000
+        ; fill the source buffer with 0, 1, 2, ...
+        LD R1, SRCP
+        LD R3, SIZE
+        AND R0, R0, #0
+INIT    STR R0, R1, #0
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        ADD R3, R3, #-1
+        BRp INIT
+        LD R5, COPIES
+OUTER   LD R1, SRCP
+        LD R2, DSTP
+        LD R3, SIZE
+COPY    LDR R4, R1, #0
+        STR R4, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp COPY
+        ADD R5, R5, #-1
+        BRp OUTER
+        ; the last word copied must be SIZE - 1
+        LDR R4, R2, #-1
+        LD R3, SIZE
+        NOT R3, R3
+        ADD R3, R3, #1
+        ADD R4, R4, R3
+        ADD R4, R4, #1
+        BRnp BAD
+        LEA R0, MSG
+        PUTS
+        HALT
+BAD     LEA R0, BADMSG
+        PUTS
+        HALT
+COPIES  .FILL #2000
+SIZE    .FILL #4096
+SRCP    .FILL x4000
+DSTP    .FILL x6000
+MSG     .STRINGZ "done\n"
+BADMSG  .STRINGZ "copy mismatch\n"
+        .END
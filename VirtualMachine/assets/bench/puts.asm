@@ -0,0 +1,12 @@
+; String output, used to measure the console output path (PUTS/OUT traps).
+; Prints a 63 character line 30000 times (~1.9MB of output).
+        .ORIG x3000
+        LD R1, COUNT
+LOOP    LEA R0, LINE
+        PUTS
+        ADD R1, R1, #-1
+        BRp LOOP
+        HALT
+COUNT   .FILL #30000
+LINE    .STRINGZ "The quick brown fox jumps over the lazy dog 0123456789 ABCDEF\n"
+        .END
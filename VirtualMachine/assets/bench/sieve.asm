@@ -0,0 +1,86 @@
+; Sieve of Eratosthenes, used to measure strided stores and loop control.
+; Finds the primes below 8000 (x4000 holds the flags) 200 times (~39M instructions)
+; and prints their count (1007).
+        .ORIG x3000
+AGAIN   LD R1, FLAGP
+        LD R2, N
+        AND R0, R0, #0
+CLEAR   STR R0, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp CLEAR
+
+        LD R1, FLAGP
+        LD R6, NEGN
+        AND R7, R7, #0
+        ADD R7, R7, #1          ; composite mark
+        AND R3, R3, #0          ; no. of primes
+        AND R2, R2, #0
+        ADD R2, R2, #2          ; p
+PRIME   ADD R4, R1, R2
+        LDR R0, R4, #0
+        BRp NEXT                ; composite
+        ADD R3, R3, #1
+        ADD R5, R2, R2          ; m = 2p
+MARK    ADD R0, R5, R6
+        BRzp NEXT               ; m >= N
+        ADD R4, R1, R5
+        STR R7, R4, #0
+        ADD R5, R5, R2
+        BRnzp MARK
+NEXT    ADD R2, R2, #1
+        ADD R0, R2, R6
+        BRn PRIME
+
+        LD R0, REPEAT
+        ADD R0, R0, #-1
+        ST R0, REPEAT
+        BRp AGAIN
+
+        ADD R0, R3, #0
+        JSR PRDEC
+        HALT
+REPEAT  .FILL #200
+N       .FILL #8000
+NEGN    .FILL #-8000
+FLAGP   .FILL x4000
+
+; prints R0 (0 - 32767) in decimal followed by a newline, uses R0-R5
+PRDEC   ST R7, PDR7
+        LEA R3, PDTAB
+        AND R4, R4, #0          ; != 0 once a digit has been printed
+PDNEXT  LDR R2, R3, #0          ; -(10^k), 0 ends the table
+        BRz PDLAST
+        AND R1, R1, #0          ; digit
+PDSUB   ADD R5, R0, R2
+        BRn PDDIG
+        ADD R0, R5, #0
+        ADD R1, R1, #1
+        BRnzp PDSUB
+PDDIG   ADD R3, R3, #1
+        ADD R5, R1, R4          ; skip the leading zeros
+        BRz PDNEXT
+        ADD R4, R4, #1
+        ST R0, PDR0
+        LD R0, PDASC
+        ADD R0, R0, R1
+        OUT
+        LD R0, PDR0
+        BRnzp PDNEXT
+PDLAST  LD R1, PDASC
+        ADD R0, R0, R1
+        OUT
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PDR7
+        RET
+PDR7    .FILL 0
+PDR0    .FILL 0
+PDASC   .FILL x30
+PDTAB   .FILL #-10000
+        .FILL #-1000
+        .FILL #-100
+        .FILL #-10
+        .FILL 0
+        .END
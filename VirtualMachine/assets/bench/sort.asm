@@ -0,0 +1,78 @@
+; Insertion sort, used to measure data dependent branches and array accesses.
+; Sorts 600 pseudo random words (x4000) 40 times (~30M instructions), then
+; checks the order and prints "sorted".
+        .ORIG x3000
+AGAIN   ; fill the array with x = 5x + 13 (mod 2^16), masked to 15 bits so that
+        ; the compares (a - b) can't overflow
+        LD R1, ARRP
+        LD R2, SIZE
+        LD R3, SEED
+        LD R4, MASK
+FILL    ADD R0, R3, R3
+        ADD R0, R0, R0
+        ADD R0, R0, R3
+        ADD R3, R0, #13
+        AND R0, R3, R4
+        STR R0, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp FILL
+        ST R3, SEED
+
+        ; for i = 1 .. SIZE - 1: insert A[i] into the sorted A[0 .. i - 1]
+        LD R1, ARRP
+        AND R2, R2, #0
+        ADD R2, R2, #1          ; i
+OUTER   ADD R3, R1, R2
+        LDR R4, R3, #0          ; key = A[i]
+        NOT R7, R4
+        ADD R7, R7, #1          ; -key
+        ADD R5, R3, #-1         ; p = &A[j]
+        ADD R6, R2, #-1         ; j = i - 1
+INNER   BRn PLACE               ; j < 0
+        LDR R0, R5, #0
+        ADD R3, R0, R7          ; A[j] - key
+        BRnz PLACE
+        STR R0, R5, #1          ; A[j + 1] = A[j]
+        ADD R5, R5, #-1
+        ADD R6, R6, #-1
+        BRnzp INNER
+PLACE   STR R4, R5, #1
+        ADD R2, R2, #1
+        LD R0, NEGSIZE
+        ADD R0, R2, R0
+        BRn OUTER
+
+        LD R0, REPEAT
+        ADD R0, R0, #-1
+        ST R0, REPEAT
+        BRp AGAIN
+
+        ; check A[i] <= A[i + 1]
+        LD R1, ARRP
+        LD R2, SIZE
+        ADD R2, R2, #-1
+CHECK   LDR R0, R1, #0
+        NOT R0, R0
+        ADD R0, R0, #1
+        LDR R3, R1, #1
+        ADD R3, R3, R0
+        BRn BAD
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp CHECK
+        LEA R0, MSG
+        PUTS
+        HALT
+BAD     LEA R0, BADMSG
+        PUTS
+        HALT
+REPEAT  .FILL #40
+SIZE    .FILL #600
+NEGSIZE .FILL #-600
+SEED    .FILL #12345
+MASK    .FILL x7FFF
+ARRP    .FILL x4000
+MSG     .STRINGZ "sorted\n"
+BADMSG  .STRINGZ "not sorted\n"
+        .END
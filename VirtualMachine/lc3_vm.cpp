@@ -1,13 +1,33 @@
 #include <iostream>
 #include <csignal>
 #include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 // IO, terminal console related to unix
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <string>
+#include <chrono>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/termios.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -18,11 +38,84 @@ using namespace std;
 // Total memory size supported = 2^16 * 2B = 2^17 Bytes = 128KB
 const int MEMORY_MAX = 1 << 16;
 
-// Memory representation for this VM
-uint16_t memory[MEMORY_MAX];
-
 #pragma endregion Constants
 
+#pragma region Decoded instruction cache
+
+// Micro-ops are the handlers of the dispatch loop. Most map 1:1 to an opcode, the
+// ones with 2 variants (eg ADD vs ADD IMM) are split so that the handler doesn't have
+// to check the mode bit on every execution.
+enum MicroOp {
+    UOP_DECODE = 0, // slot not decoded yet (or invalidated by a memory write)
+    UOP_BR,
+    UOP_BR_ALWAYS, // BRnzp / BR
+    UOP_ADD,
+    UOP_ADD_IMM,
+    UOP_AND,
+    UOP_AND_IMM,
+    UOP_NOT,
+    UOP_LD,
+    UOP_LDI,
+    UOP_LDR,
+    UOP_LEA,
+    UOP_ST,
+    UOP_STI,
+    UOP_STR,
+    UOP_JMP,
+    UOP_JSR,
+    UOP_JSRR,
+    UOP_TRAP,
+    UOP_NOP, // RTI, RES and branches which can never be taken
+    UOP_BREAK, // breakpoint, the slot's instruction runs after the debugger continues
+    // superinstructions, a whole instruction sequence in one handler (see fuse_instructions)
+    UOP_LOAD_CONST, // AND R, x, #0; ADD R, R, #imm
+    UOP_ADD_IMM_BR, // ADD R, x, #imm; BR
+    UOP_ADD_BR, // ADD R, x, y; BR
+    UOP_LDR_ADD_STR, // LDR R, B, #o; ADD R, R, #imm; STR R, B, #o
+    UOP_COUNT
+};
+
+const int UOP_FIRST_FUSED = UOP_LOAD_CONST;
+
+const char* const UOP_NAMES[UOP_COUNT] = {
+    "DECODE", "BR", "BR_ALWAYS", "ADD", "ADD_IMM", "AND", "AND_IMM", "NOT", "LD", "LDI", "LDR",
+    "LEA", "ST", "STI", "STR", "JMP", "JSR", "JSRR", "TRAP", "NOP", "BREAK",
+    "LOAD_CONST", "ADD_IMM_BR", "ADD_BR", "LDR_ADD_STR"
+};
+
+// Instruction word with all its operands already extracted.
+// Operand names follow the instruction formats: a = bits [11:9] (DR, SR or nzp),
+// b = bits [8:6] (SR1 or BaseR), c = bits [2:0] (SR2)
+struct DecodedInstruction {
+    uint8_t op; // MicroOp, index of the handler in the dispatch loop
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint16_t imm; // sign extended imm5 / offset6 / PCoffset9 / PCoffset11, trap code for TRAP
+    uint16_t imm2; // 2nd operand of the superinstructions
+};
+
+#pragma endregion Decoded instruction cache
+
+#pragma region Memory mapped devices
+
+// The address space is split into 256 pages of 256 words. A page is either plain RAM,
+// which loads/stores access directly, or it belongs to a device whose handlers get
+// every access to the page (eg the keyboard registers in the 0xFE00 page).
+const int PAGE_SHIFT = 8;
+const int PAGE_COUNT = MEMORY_MAX >> PAGE_SHIFT;
+
+class LC3Machine;
+
+// Handlers get the machine which did the access, so one device can be mapped
+// into any number of machines as long as it keeps its state in the machine.
+struct Device {
+    uint16_t (*read)(LC3Machine& machine, uint16_t address);
+    void (*write)(LC3Machine& machine, uint16_t data, uint16_t address);
+};
+
+#pragma endregion Memory mapped devices
+
 #pragma region Registers
 // LC-3 supports 8 general purpose registers and 2 special purpose registers - PC and COND
 enum Register {
@@ -44,9 +137,6 @@ enum MemoryRegister {
     MR_KBDR = 0xFE02 // Keyboard data register, can be used to know the key that was pressed
 };
 
-// Tracks the registers of the VM
-uint16_t registers[R_COUNT];
-
 #pragma endregion Registers
 
 #pragma region Opcodes
@@ -72,6 +162,52 @@ enum Opcode {
     OP_TRAP, // trap
 };
 
+// Operand layout of an opcode, how the disassembler and the trace dump show its operands
+enum OperandFormat : uint8_t {
+    FMT_ALU, // DR, SR1, SR2 / #imm5
+    FMT_NOT, // DR, SR
+    FMT_BR, // nzp, PCoffset9 (NOP without condition bits)
+    FMT_JMP, // BaseR (RET for R7)
+    FMT_JSR, // PCoffset11 / JSRR BaseR
+    FMT_PC_RELATIVE, // DR / SR, PCoffset9
+    FMT_BASE_OFFSET, // DR / SR, BaseR, offset6
+    FMT_TRAP, // trapvect8
+    FMT_NONE,
+};
+
+// register an opcode writes
+enum Destination : uint8_t {
+    DEST_NONE,
+    DEST_DR, // bits [11:9]
+    DEST_R7, // the return address
+};
+
+struct OpcodeInfo {
+    const char* name;
+    OperandFormat format;
+    Destination destination;
+};
+
+// Decode table, indexed by opcode
+constexpr OpcodeInfo OPCODES[16] = {
+    { "BR", FMT_BR, DEST_NONE },
+    { "ADD", FMT_ALU, DEST_DR },
+    { "LD", FMT_PC_RELATIVE, DEST_DR },
+    { "ST", FMT_PC_RELATIVE, DEST_NONE },
+    { "JSR", FMT_JSR, DEST_R7 },
+    { "AND", FMT_ALU, DEST_DR },
+    { "LDR", FMT_BASE_OFFSET, DEST_DR },
+    { "STR", FMT_BASE_OFFSET, DEST_NONE },
+    { "RTI", FMT_NONE, DEST_NONE },
+    { "NOT", FMT_NOT, DEST_DR },
+    { "LDI", FMT_PC_RELATIVE, DEST_DR },
+    { "STI", FMT_PC_RELATIVE, DEST_NONE },
+    { "JMP", FMT_JMP, DEST_NONE },
+    { "RES", FMT_NONE, DEST_NONE },
+    { "LEA", FMT_PC_RELATIVE, DEST_DR },
+    { "TRAP", FMT_TRAP, DEST_R7 }, // and R0 for GETC / IN
+};
+
 #pragma endregion Opcodes
 
 #pragma region Condition Flag
@@ -83,6 +219,12 @@ enum COND {
     FL_NEG = 1 << 2, // Negative
 };
 
+// The condition flag is evaluated lazily: ALU ops and loads only record their result
+// (LC3Machine::cond_result) and N/Z/P is derived from it when a BR actually reads the flag,
+// most results are never tested so this saves the compares and the flag store on the hot path.
+// registers[R_COND] is only brought up to date by sync_cond_register(), whenever the full
+// register state gets inspected.
+
 #pragma endregion Condition Flag
 
 #pragma region Trap code
@@ -114,6 +256,76 @@ uint16_t swap_byte_layout16(uint16_t val) {
     return (val << 8) | (val >> 8);
 }
 
+// Bulk version of swap_byte_layout16 used by the image loader: dst[i] = swap(src[i]).
+// On x86-64 the words are swapped 16 (AVX2) or 8 (SSSE3) at a time with a pshufb byte
+// shuffle, the kernel is picked at runtime from what the CPU supports (the functions are
+// compiled with target attributes, so no -m flags are needed). The remaining words go
+// through the scalar loop.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LC3_SIMD_SWAP 1
+#else
+#define LC3_SIMD_SWAP 0
+#endif
+
+void swap_words_scalar(uint16_t* dst, const uint16_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = swap_byte_layout16(src[i]);
+}
+
+#if LC3_SIMD_SWAP
+// both return the no. of words swapped, a multiple of the vector width
+__attribute__((target("ssse3")))
+size_t swap_words_ssse3(uint16_t* dst, const uint16_t* src, size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(words, shuffle));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t swap_words_avx2(uint16_t* dst, const uint16_t* src, size_t count) {
+    // vpshufb shuffles within each 128bit lane, so the pattern is repeated for both lanes
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i words = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(words, shuffle));
+    }
+    return i;
+}
+#endif
+
+enum SwapKernel { SWAP_SCALAR = 0, SWAP_SSSE3, SWAP_AVX2 };
+
+SwapKernel detect_swap_kernel() {
+#if LC3_SIMD_SWAP
+    if (__builtin_cpu_supports("avx2"))
+        return SWAP_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return SWAP_SSSE3;
+#endif
+    return SWAP_SCALAR;
+}
+
+const SwapKernel swap_kernel = detect_swap_kernel();
+
+void swap_words(uint16_t* dst, const uint16_t* src, size_t count, SwapKernel kernel = swap_kernel) {
+    size_t done = 0;
+#if LC3_SIMD_SWAP
+    if (kernel == SWAP_AVX2)
+        done = swap_words_avx2(dst, src, count);
+    else if (kernel == SWAP_SSSE3)
+        done = swap_words_ssse3(dst, src, count);
+#endif
+    // scalar tail
+    swap_words_scalar(dst + done, src + done, count - done);
+}
+
 uint16_t sign_extend_bits(uint16_t bit_count, uint16_t value) {
     // bit_count is the no. of bits in the value, it might be < 16 and hence
     // the remaining positions have to be filled depending on the sign of number.
@@ -124,20 +336,493 @@ uint16_t sign_extend_bits(uint16_t bit_count, uint16_t value) {
     return value;
 }
 
-void update_cond_flag(uint16_t reg) {
-    // COND register's value is updated based on the value of
-    // last computation which is stored in the register
-    uint16_t value = registers[reg];
+// N/Z/P flag for a computation result
+inline uint16_t cond_flag_of(uint16_t value) {
+    if (value == 0)
+        return FL_ZRO;
+    // if the MSB is 1, then it is a negative number
+    return (value >> 15) ? FL_NEG : FL_POS;
+}
+
+// Keyboard input is read by a dedicated thread which blocks on stdin and pushes the bytes
+// into a single producer / single consumer lock-free ring. The VM side (KBSR polls, GETC/IN)
+// only looks at the ring, so polling the keyboard is an atomic load instead of a select() syscall.
+// There is only one stdin per process, so there is only one ring (see TerminalIO).
+const size_t INPUT_RING_SIZE = 1024; // power of 2
 
-    if (value == 0) 
-        registers[R_COND] = FL_ZRO;
-    else if (value >> 15) // if the MSB is 1, then it is a negative number
-        registers[R_COND] = FL_NEG;
-    else
-        registers[R_COND] = FL_POS;
+struct InputRing {
+    unsigned char data[INPUT_RING_SIZE];
+    atomic<size_t> head{0}; // next slot written by the input thread
+    atomic<size_t> tail{0}; // next slot read by the VM
+    atomic<bool> eof{false}; // stdin is closed, set after the last byte is pushed
+};
+
+InputRing input_ring;
+// only used to sleep when the VM does a blocking read on an empty ring
+mutex input_mutex;
+condition_variable input_ready;
+
+void input_thread_main() {
+    unsigned char buffer[256];
+    for (;;) {
+        ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // stdin was left non-blocking, nothing to read yet
+            this_thread::sleep_for(chrono::milliseconds(1));
+            continue;
+        }
+        // only end of file or a real error ends the input
+        if (count <= 0) {
+            input_ring.eof.store(true, memory_order_release);
+        }
+        for (ssize_t i = 0; i < count; ++i) {
+            size_t head = input_ring.head.load(memory_order_relaxed);
+            // ring full, wait for the VM to catch up
+            while (head - input_ring.tail.load(memory_order_acquire) == INPUT_RING_SIZE)
+                this_thread::sleep_for(chrono::milliseconds(1));
+            input_ring.data[head & (INPUT_RING_SIZE - 1)] = buffer[i];
+            input_ring.head.store(head + 1, memory_order_release);
+        }
+        // wake up a blocking read, taking the lock makes sure the reader is either
+        // already waiting or will see the new bytes before it waits
+        {
+            lock_guard<mutex> lock(input_mutex);
+        }
+        input_ready.notify_one();
+        if (count <= 0)
+            return;
+    }
+}
+
+void start_input_thread() {
+    thread(input_thread_main).detach();
+}
+
+// true if a byte (or EOF) can be read without blocking
+inline bool input_ring_available() {
+    return input_ring.tail.load(memory_order_relaxed) != input_ring.head.load(memory_order_acquire)
+        || input_ring.eof.load(memory_order_acquire);
+}
+
+// next input byte, blocks until there is one. Returns EOF (-1) like getchar once stdin is closed
+int input_ring_read() {
+    if (!input_ring_available()) {
+        unique_lock<mutex> lock(input_mutex);
+        input_ready.wait(lock, [] { return input_ring_available(); });
+    }
+    size_t tail = input_ring.tail.load(memory_order_relaxed);
+    if (tail == input_ring.head.load(memory_order_acquire))
+        return EOF;
+    unsigned char ch = input_ring.data[tail & (INPUT_RING_SIZE - 1)];
+    input_ring.tail.store(tail + 1, memory_order_release);
+    return ch;
+}
+
+// Console output is collected in a buffer instead of a write per char. It is flushed on a
+// newline, when the buffer is full, before the VM blocks waiting for input (GETC/IN or a
+// KBSR poll which finds no key, so a prompt is always visible) and when the program halts.
+const size_t OUTPUT_BUFFER_SIZE = 4096;
+
+// Console of a machine: where the keyboard input (KBSR/KBDR, GETC, IN) comes from and
+// where the output of the traps goes. The default is the process terminal (TerminalIO),
+// other implementations can eg feed a job its input from memory and capture its output.
+class LC3IO {
+public:
+    virtual ~LC3IO() {}
+
+    // true if a byte (or EOF) can be read without blocking
+    virtual bool input_available() = 0;
+    // next input byte, blocks until there is one. Returns EOF (-1) once the input is closed
+    virtual int input_read() = 0;
+    // true if GETC/IN halt the machine at EOF instead of returning xFFFF to the program
+    virtual bool halt_at_end_of_input() { return false; }
+
+    inline void output_char(char ch) {
+        output_buffer[output_used++] = ch;
+        if (ch == '\n' || output_used == OUTPUT_BUFFER_SIZE)
+            output_flush();
+    }
+
+    void output_string(const char* str) {
+        while (*str)
+            output_char(*str++);
+    }
+
+    void output_flush() {
+        if (output_used) {
+            write_output(output_buffer, output_used);
+            output_used = 0;
+        }
+    }
+
+protected:
+    // receives the buffered output
+    virtual void write_output(const char* data, size_t size) = 0;
+
+private:
+    char output_buffer[OUTPUT_BUFFER_SIZE];
+    size_t output_used = 0;
+};
+
+// The process terminal: input from stdin through the input thread, output to stdout
+class TerminalIO : public LC3IO {
+public:
+    bool input_available() override {
+        return input_ring_available();
+    }
+
+    int input_read() override {
+        return input_ring_read();
+    }
+
+    void disable_input_buffering() {
+        // save the terminal settings, which can be restored later
+        tcgetattr(STDIN_FILENO, &original_tio);
+        struct termios new_tio = original_tio;
+        // c_lflag controls the various terminal functions,
+        // disable canonical mode (line by line input) and input echo
+        // with canonical disabled, the input is taken char by char
+        new_tio.c_lflag &= ~ICANON & ~ECHO;
+        // set the new terminal settings
+        tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    }
+
+    void restore_input_buffering() {
+        // restore the orig terminal settings
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
+
+protected:
+    void write_output(const char* data, size_t size) override {
+        fwrite(data, 1, size, stdout);
+        fflush(stdout);
+    }
+
+private:
+    // saves the current terminal settings
+    struct termios original_tio;
+};
+
+// there is one terminal per process, shared by the machines which use it
+TerminalIO terminal;
+
+// Scripted console: the keyboard input comes from a buffer in memory and the output goes to
+// a FILE, so a run needs no terminal, no input thread and no syscalls for input. The same
+// script always gives the same run. Once the script is consumed the keyboard reports EOF
+// (KBDR xFFFF) and GETC/IN halt the machine, so an interactive program like 2048 ends
+// instead of waiting for keys which never come.
+class ScriptIO : public LC3IO {
+public:
+    ScriptIO(const char* input, size_t size, FILE* out)
+        : input_start(input), input(input), input_end(input + size), out(out) {}
+
+    bool input_available() override {
+        return true; // either a byte or EOF
+    }
+
+    int input_read() override {
+        if (input == input_end) {
+            input_ended = true;
+            return EOF;
+        }
+        return (unsigned char)*input++;
+    }
+
+    bool halt_at_end_of_input() override {
+        return true;
+    }
+
+    // set once the program read past the end of the script
+    bool input_ended = false;
+
+    // bytes of the script read so far, seek_input goes back (or forward) to such a point
+    size_t input_position() const {
+        return input - input_start;
+    }
+
+    void seek_input(size_t position, bool ended) {
+        input = input_start + position;
+        input_ended = ended;
+    }
+
+protected:
+    void write_output(const char* data, size_t size) override {
+        fwrite(data, 1, size, out);
+    }
+
+private:
+    const char* input_start;
+    const char* input;
+    const char* input_end;
+    FILE* out;
+};
+
+bool read_whole_file(const char* path, string& data) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.append(buffer, count);
+    fclose(file);
+    return true;
+}
+
+void interrupt_handler(int signal) {
+    // restore the terminal settings before exiting
+    terminal.restore_input_buffering();
+    terminal.output_flush();
+    cout << "Received signal: " << signal << endl;
+    exit(-2);
+}
+
+#pragma endregion VM utils
+
+#pragma region Machine
+
+struct JitState;
+struct Watchpoints;
+
+// why the engine returned while the program can still continue (see Breakpoints and watchpoints)
+const uint8_t PAUSE_BREAKPOINT = 1;
+const uint8_t PAUSE_WATCHPOINT = 2;
+
+// Memory is also split into pages for the dirty page tracking of forked machines (see
+// fork_from), 64 pages of 1K words so the dirty pages of a machine fit in one word.
+const int DIRTY_PAGE_SHIFT = 10;
+const size_t DIRTY_PAGE_SIZE = 1 << DIRTY_PAGE_SHIFT;
+const size_t DIRTY_PAGE_COUNT = MEMORY_MAX >> DIRTY_PAGE_SHIFT;
+
+// Registers and memory of a machine, kept outside of any machine so that other machines
+// can be forked from it, eg a snapshot which was read once.
+struct MachineState {
+    uint16_t registers[R_COUNT]; // R_COND is synced with the condition flag
+    uint16_t memory[MEMORY_MAX];
+};
+
+// Complete state of one LC-3 machine: memory, registers, the caches derived from memory
+// and the devices. Nothing on the execution path touches globals, so a process can run
+// any number of machines (eg one per thread), each with its own console (LC3IO).
+// A machine is ~800KB, allocate it on the heap or statically rather than on the stack.
+class LC3Machine {
+public:
+    // Memory representation for this VM
+    uint16_t memory[MEMORY_MAX] = {};
+    // Tracks the registers of the VM
+    uint16_t registers[R_COUNT] = {};
+    // result the condition flag is derived from (see Condition Flag)
+    uint16_t cond_result = 0;
+
+    // Runs parallel to memory, decoded[addr] caches the decoded form of memory[addr].
+    // Slots are filled lazily the first time the address is executed and are reset
+    // to UOP_DECODE by memory_write, so self-modifying code still sees its writes.
+    DecodedInstruction decoded[MEMORY_MAX] = {};
+
+    // device owning each page, nullptr for RAM pages
+    Device* page_devices[PAGE_COUNT] = {};
+
+    // no. of compiled JIT blocks covering each address, a write to a covered address
+    // has to drop those blocks (see JIT compiler)
+    uint8_t jit_covered[MEMORY_MAX] = {};
+    // JIT tier state, nullptr until jit_init()
+    JitState* jit = nullptr;
+
+    // instruction budget of run_decoded/run_jit, unlimited until set_budget is called
+    bool budgeted = false;
+    int64_t budget_left = 0;
+    // set when a run stopped because the budget was used up rather than because the program halted
+    bool budget_exhausted = false;
+
+    // set by request_halt(), the program stops after the instruction which is running
+    bool halt_requested = false;
+    // PAUSE_*, set instead when the engine stopped at a breakpoint / watchpoint, cleared by request_halt
+    uint8_t paused = 0;
+
+    // Breakpoints, bit n % 64 of breakpoints[n / 64] is address n. Only the slow paths look at
+    // them: the decoder puts UOP_BREAK in the slot, the JIT ends its blocks before them.
+    uint64_t breakpoints[MEMORY_MAX / 64] = {};
+    int breakpoint_count = 0;
+    // watched addresses, nullptr until the first watch()
+    Watchpoints* watchpoints = nullptr;
+
+    // state the machine was forked from (nullptr if it wasn't) and the pages written since,
+    // bit n is page n. reset() only has to copy those pages back.
+    const MachineState* fork_base = nullptr;
+    uint64_t dirty_pages = 0;
+
+    LC3IO* io;
+
+    // the keyboard device is mapped on the 0xFE00 page
+    explicit LC3Machine(LC3IO* io);
+    ~LC3Machine();
+    LC3Machine(const LC3Machine&) = delete;
+    LC3Machine& operator=(const LC3Machine&) = delete;
+
+    void update_cond_flag(uint16_t reg) {
+        // COND register's value is based on the value of last computation which
+        // is stored in the register, only the value is recorded (see cond_result)
+        cond_result = registers[reg];
+    }
+
+    uint16_t read_cond_flag() const {
+        return cond_flag_of(cond_result);
+    }
+
+    // sets the condition flag directly (eg reset), records a result which has that flag
+    void set_cond_flag(uint16_t flag) {
+        if (flag == FL_NEG)
+            cond_result = 0x8000;
+        else
+            cond_result = (flag == FL_POS) ? 1 : 0;
+    }
+
+    // makes registers[R_COND] reflect the lazily evaluated condition flag
+    void sync_cond_register() {
+        registers[R_COND] = read_cond_flag();
+    }
+
+    bool is_device_page(uint16_t address) const {
+        return page_devices[address >> PAGE_SHIFT] != nullptr;
+    }
+
+    // drops the decoded form of the word at address, and the superinstruction which
+    // starts up to 2 words before and includes it
+    void drop_slot(uint16_t address) {
+        decoded[address].op = UOP_DECODE;
+        if (decoded[(uint16_t)(address - 1)].op >= UOP_FIRST_FUSED)
+            decoded[(uint16_t)(address - 1)].op = UOP_DECODE;
+        if (decoded[(uint16_t)(address - 2)].op == UOP_LDR_ADD_STR)
+            decoded[(uint16_t)(address - 2)].op = UOP_DECODE;
+    }
+
+    // store to the memory array itself
+    void ram_write(uint16_t data, uint16_t address) {
+        memory[address] = data;
+        dirty_pages |= 1ull << (address >> DIRTY_PAGE_SHIFT);
+        // the word might have been executed before
+        drop_slot(address);
+        if (jit_covered[address])
+            jit_invalidate(address);
+    }
+
+    void memory_write(uint16_t data, uint16_t address) {
+        Device* device = page_devices[address >> PAGE_SHIFT];
+        if (device) {
+            device->write(*this, data, address);
+            return;
+        }
+        ram_write(data, address);
+    }
+
+    uint16_t memory_read(uint16_t address) {
+        // RAM pages are read directly, device pages go to their handler
+        Device* device = page_devices[address >> PAGE_SHIFT];
+        if (device)
+            return device->read(*this, address);
+        return memory[address];
+    }
+
+    void map_device(uint16_t page, Device* device);
+    void set_budget(int64_t instructions);
+
+    // Stops the program from outside the trap handlers, eg a device, after the instruction
+    // which is running. Only a device access can ask for it, so the engines check the flag
+    // after their loads and stores which reached a device (and the JIT dispatcher after every
+    // block), the caches stay as they are.
+    void request_halt() {
+        halt_requested = true;
+        paused = 0;
+    }
+
+    // Stops the program like request_halt, at a watchpoint. It continues when the engine is
+    // run again after clearing halt_requested and paused.
+    void request_pause() {
+        request_halt();
+        paused = PAUSE_WATCHPOINT;
+    }
+
+    bool is_breakpoint(uint16_t address) const {
+        return breakpoints[address >> 6] >> (address & 63) & 1;
+    }
+
+    // the decoder's part of the breakpoints, d is the slot just decoded for address
+    void apply_breakpoints(uint16_t address, DecodedInstruction& d);
+
+    // drops the decoded form of words [address, address + count), after a bulk write to memory
+    void drop_decoded(uint16_t address, size_t count) {
+        // eg an image with only the origin, address + count - 1 would wrap around
+        if (count == 0)
+            return;
+        for (size_t page = address >> DIRTY_PAGE_SHIFT; page <= (address + count - 1) >> DIRTY_PAGE_SHIFT; ++page)
+            dirty_pages |= 1ull << page;
+        // UOP_DECODE is 0
+        memset(decoded + address, 0, count * sizeof(DecodedInstruction));
+        // superinstructions starting before address might include the new words
+        decoded[(uint16_t)(address - 1)].op = UOP_DECODE;
+        decoded[(uint16_t)(address - 2)].op = UOP_DECODE;
+    }
+
+    // all return the no. of words loaded, the path versions return -1 if the file can't be opened.
+    // load_image maps the file (or reads a small one in one go) and swaps it straight into
+    // memory (see swap_words), load_image_stdio is the plain fread path
+    int read_image_file(FILE* file);
+    int load_image(const char* path);
+    int load_image_stdio(const char* path);
+    // image[0] is the origin, the words follow in host byte order (see Assembler)
+    int load_words(const vector<uint16_t>& image);
+
+    // continue from saved registers and memory (see Snapshots)
+    void restore_state(const uint16_t* saved_registers, const uint16_t* saved_memory);
+    // false if the file can't be written, or read or isn't a snapshot of this version
+    bool save_snapshot(const char* path);
+    bool restore_snapshot(const char* path);
+    // continue from base and remember it, reset() goes back to it by copying only the pages
+    // written since. base has to outlive the machine (or the next fork_from).
+    void fork_from(const MachineState& base);
+    void reset();
+
+    // see Breakpoints and watchpoints
+    void set_breakpoint(uint16_t address, bool enabled);
+    // flags are WATCH_*, 0 removes the watchpoint
+    void watch(uint16_t address, uint8_t flags);
+
+    bool execute_trap(uint16_t instruction, bool run);
+    bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run);
+    void run_decoded();
+    template <class Monitor> void run_decoded(Monitor& monitor);
+
+    bool jit_init();
+    void jit_flush();
+    void jit_invalidate(uint16_t address);
+    void run_jit();
+};
+
+// all the accesses to the device page go through the device handlers (and pages
+// the compiled code assumed to be RAM might not be anymore)
+void LC3Machine::map_device(uint16_t page, Device* device) {
+    page_devices[page] = device;
+    // instructions are fetched through the device too, the page's words can't stay decoded
+    for (int offset = 0; offset < (1 << PAGE_SHIFT); ++offset)
+        drop_slot((page << PAGE_SHIFT) + offset);
+    jit_flush();
 }
 
-void read_image_file(FILE* file) {
+// Lets run_decoded/run_jit execute at most that many more instructions. A run which uses up
+// the budget returns with budget_exhausted set and PC at the next instruction.
+void LC3Machine::set_budget(int64_t instructions) {
+    if (!budgeted) {
+        budgeted = true;
+        // compiled code only keeps track of the budget if it was compiled with one
+        jit_flush();
+    }
+    budget_left = instructions;
+    budget_exhausted = false;
+}
+
+int LC3Machine::read_image_file(FILE* file) {
     // the LC3 machine code file starts with a 16-bit value that represents the starting address of the program
     // we will load the contents of the file into the memory starting from this address.
     uint16_t origin = 0;
@@ -158,92 +843,215 @@ void read_image_file(FILE* file) {
         *file_ptr = swap_byte_layout16(*file_ptr);
         ++file_ptr;
     }
-
-    cout << "Loaded image file into memory, size: " << lines_read * 2 << " Bytes" << endl;
+    drop_decoded(origin, lines_read);
+    return lines_read;
 }
 
-bool load_image(const char* path) {
-    cout << "Image path: " << path << endl;
-
+int LC3Machine::load_image_stdio(const char* path) {
     FILE* img_file = fopen(path, "rb");
     if (!img_file)
-        return false;
+        return -1;
     
-    read_image_file(img_file);
+    int words = read_image_file(img_file);
     fclose(img_file);
-    return true;
+    return words;
 }
 
-uint16_t check_keypress() {
-    // set of file descp to check for read events
-    fd_set readfds;
-    FD_ZERO(&readfds); // init to empty set
-    FD_SET(STDIN_FILENO, &readfds); // add stdin for tracking input event
+// images up to this size are read() into a stack buffer, for them setting up and tearing
+// down the mapping costs more than the copy it saves
+const size_t IMAGE_MMAP_THRESHOLD = 16 << 10;
+
+int LC3Machine::load_image(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < 2) {
+        // not a regular file (eg a pipe) or too small to have an origin
+        close(fd);
+        return load_image_stdio(path);
+    }
+
+    uint16_t buffer[IMAGE_MMAP_THRESHOLD / 2];
+    const uint16_t* image = buffer;
+    size_t size = info.st_size;
+    void* mapped = MAP_FAILED;
+    if (size <= IMAGE_MMAP_THRESHOLD) {
+        ssize_t count = read(fd, buffer, size);
+        size = count < 0 ? 0 : count;
+    }
+    else {
+        mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return load_image_stdio(path);
+        }
+        image = (const uint16_t*)mapped;
+    }
+    close(fd);
+    if (size < 2)
+        return load_image_stdio(path);
+
+    // same layout as read by read_image_file: the origin followed by the words to place there
+    uint16_t origin = swap_byte_layout16(image[0]);
+    size_t words = (size - 2) / 2;
+    if (words > (size_t)(MEMORY_MAX - origin))
+        words = MEMORY_MAX - origin;
 
-    // set the polling properties for select operation
-    // set the timeout (both sec and micro-sec) to 0, so that select will return immediately without blocking
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
+    swap_words(memory + origin, image + 1, words);
+    drop_decoded(origin, words);
 
-    // select will return the no. of file descp that have events
-    // The select function monitors the file descriptors in the sets provided for readability, writability, and exceptional conditions.
-    // the 1st arg of select is basically the max count + 1 till which the FD should be monitored, here we are
-    // monitoring only stdin, so we set it to STDIN_FILENO + 1
-    return select(STDIN_FILENO + 1, &readfds, NULL, NULL, &timeout);
+    if (mapped != MAP_FAILED)
+        munmap(mapped, info.st_size);
+    return words;
 }
 
-void memory_write(uint16_t data, uint16_t address) {
-    memory[address] = data;
+int LC3Machine::load_words(const vector<uint16_t>& image) {
+    uint16_t origin = image[0];
+    size_t words = min(image.size() - 1, (size_t)(MEMORY_MAX - origin));
+    memcpy(memory + origin, image.data() + 1, words * sizeof(uint16_t));
+    drop_decoded(origin, words);
+    return words;
 }
 
-uint16_t memory_read(uint16_t address) {
+uint16_t keyboard_read(LC3Machine& machine, uint16_t address) {
     // special case: if it is memory mapped KB status reg, then check for
     // any updated status for keyboard
     if (address == MR_KBSR) {
         // if there is a key press, set the KB status to 1
-        if (check_keypress()) {
-            memory[MR_KBSR] = (1 << 15); // MSB 1 indicating KB event
-            memory[MR_KBDR] = getchar();
+        if (machine.io->input_available()) {
+            int ch = machine.io->input_read();
+            if (ch == EOF && machine.io->halt_at_end_of_input()) {
+                // scripted input is consumed, stop instead of letting the program poll forever
+                machine.request_halt();
+                machine.ram_write(0, MR_KBSR);
+                return 0;
+            }
+            machine.ram_write(1 << 15, MR_KBSR); // MSB 1 indicating KB event
+            machine.ram_write(ch, MR_KBDR);
         }
         else {
-            memory[MR_KBSR] = 0;
+            machine.ram_write(0, MR_KBSR);
+            // the program is waiting for a key, make sure what it printed so far is visible
+            machine.io->output_flush();
         }
     }
 
-    return memory[address];
+    return machine.memory[address];
 }
 
-// saves the current terminal settings
-struct termios original_tio;
-
-void disable_input_buffering() {
-    // save the terminal settings, which can be restored later
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    // c_lflag controls the various terminal functions,
-    // disable canonical mode (line by line input) and input echo
-    // with canonical disabled, the input is taken char by char
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    // set the new terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+void keyboard_write(LC3Machine& machine, uint16_t data, uint16_t address) {
+    machine.ram_write(data, address);
 }
 
-void restore_input_buffering() {
-    // restore the orig terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-}
+// keyboard registers (KBSR, KBDR), the rest of the page behaves like RAM.
+// The device itself is stateless, so all machines share it.
+Device keyboard_device = { keyboard_read, keyboard_write };
 
-void interrupt_handler(int signal) {
-    // restore the terminal settings before exiting
-    restore_input_buffering();
-    cout << "Received signal: " << signal << endl;
-    exit(-2);
+LC3Machine::LC3Machine(LC3IO* io) : io(io) {
+    // memory mapped devices
+    map_device(MR_KBSR >> PAGE_SHIFT, &keyboard_device);
 }
 
-#pragma endregion VM utils
+#pragma endregion Machine
+
+bool LC3Machine::execute_trap(uint16_t instruction, bool run) {
+    // Trap routines are used to perform high-privilege operations in the LC-3 system.
+    // TRAP vector is 8 bits long, so the trap code is in the last 8 bits of the instruction
+    // Usually the trap routines are saved in the memory and the trap vector (x0000 to x00FF (256 locs))
+    // contains the starting memory location of each trap routine. When a trap instruction is executed, the PC is saved
+    // and the trap routine number is used to fetch the routine's memory addr from the trap vector.
+    // Eg TRAP x20 ; Directs the operating system to execute the GETC system call.
+    // ; The starting address of this system call is contained in memory location x0020.
+
+    // TRAP: 1111 0000 | trapvect8(8b)
+    // save the PC in R7 first before jumping to trap routine
+    registers[R_R7] = registers[R_PC];
+    // get the trap code from the last 8 bits (trapvect8)
+    uint16_t trap_code = instruction & 0xFF;
 
-bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
+    // NOTE: Since we are writing a VM to simulate the Lc3 arch, to make things simpler, instead of saving the routines at the
+    // specified memory locations and using trap vectors, we can instead handle it via the control flow similar to opcodes.
+    // In the OS implementation, the trap routines would have been saved in the memory locs and trap
+    // vector would have been used to get the routine's memory addr.
+    switch (trap_code) {
+        case TRAP_GETC:
+        {
+            // read a single char from the keyboard and store it in R0
+            io->output_flush();
+            int ch = io->input_read();
+            if (ch == EOF && io->halt_at_end_of_input()) {
+                run = false;
+                break;
+            }
+            registers[R_R0] = (uint16_t)ch;
+            update_cond_flag(R_R0);
+            break;
+        }
+        case TRAP_OUT:
+        {
+            // write a single char to the console
+            io->output_char((char)registers[R_R0]);
+            break;
+        }
+        case TRAP_PUTS:
+        {   
+            // write a word string (ASCII chars) to the console, starting addr
+            // is stored in R0, writing terminates when NULL (x0000) char is encountered
+            // NOTE: one char per memory location (16bits or 2B)
+            uint16_t* str_ptr = memory + registers[R_R0];
+            while (*str_ptr) {
+                io->output_char((char)*str_ptr);
+                ++str_ptr;
+            }
+            break;
+        }
+        case TRAP_IN:
+        {
+            // show a prompt, read a single char from the keyboard and store it in R0 and also write to console
+            io->output_string("Enter a character");
+            io->output_flush();
+            int input = io->input_read();
+            if (input == EOF && io->halt_at_end_of_input()) {
+                run = false;
+                break;
+            }
+            char ch = input;
+            io->output_char(ch);
+            registers[R_R0] = (uint16_t)ch;
+            update_cond_flag(R_R0);
+            break;
+        }
+        case TRAP_PUTSP:
+        {
+            // write a byte string to the console, starting addr is stored in R0
+            // Note: Here there are 2 chars per memory location, so each char per Byte.
+            // We need to split the 16bit word into 2 bytes and write them to console
+            uint16_t* str_ptr = memory + registers[R_R0];
+            while(*str_ptr) {
+                char ch1 = (*str_ptr) & 0xFF; // 1st Byte
+                char ch2 = (*str_ptr) >> 8; // 2nd Byte
+                io->output_char(ch1);
+                // in case of only single char, 2nd byte will be 0
+                if (ch2)
+                    io->output_char(ch2);
+                ++str_ptr;
+            }
+            break;
+        }
+        case TRAP_HALT:
+        {
+            io->output_string("Program Halted\n");
+            run = false;
+            break;
+        }
+        default:
+        break;
+    }
+    return run;
+}
+
+bool LC3Machine::eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
     switch (opcode) {
         case OP_ADD:
         {
@@ -308,7 +1116,7 @@ bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
             uint16_t nzp = (instruction >> 9) & 0x7;
             uint16_t pc_offset = sign_extend_bits(9, instruction & 0x1FF);
 
-            if (nzp & registers[R_COND])
+            if (nzp & read_cond_flag())
                 registers[R_PC] += pc_offset;
             break;
         }
@@ -322,6 +1130,8 @@ bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
         }
         case OP_JSR:
         {   // Jump register
+            // read the base register first, for JSRR R7 it gets overwritten below
+            uint16_t base = registers[(instruction >> 6) & 0x7];
             // Save the current PC in R7 and then jump to the address depending on the variant
             registers[R_R7] = registers[R_PC];
             // Jump to the address stored in the PC offset
@@ -335,7 +1145,7 @@ bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
             if (flag) // JSR
                 registers[R_PC] += sign_extend_bits(11, instruction & 0x7FF);
             else // JSRR
-                registers[R_PC] = registers[(instruction >> 6) & 0x7];
+                registers[R_PC] = base;
             break;
         }
         case OP_LD:
@@ -427,90 +1237,7 @@ bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
         }
         case OP_TRAP:
         {
-            // Trap routines are used to perform high-privilege operations in the LC-3 system.
-            // TRAP vector is 8 bits long, so the trap code is in the last 8 bits of the instruction
-            // Usually the trap routines are saved in the memory and the trap vector (x0000 to x00FF (256 locs))
-            // contains the starting memory location of each trap routine. When a trap instruction is executed, the PC is saved
-            // and the trap routine number is used to fetch the routine's memory addr from the trap vector.
-            // Eg TRAP x20 ; Directs the operating system to execute the GETC system call.
-            // ; The starting address of this system call is contained in memory location x0020.
-
-            // TRAP: 1111 0000 | trapvect8(8b)
-            // save the PC in R7 first before jumping to trap routine
-            registers[R_R7] = registers[R_PC];
-            // get the trap code from the last 8 bits (trapvect8)
-            uint16_t trap_code = instruction & 0xFF;
-
-            // NOTE: Since we are writing a VM to simulate the Lc3 arch, to make things simpler, instead of saving the routines at the
-            // specified memory locations and using trap vectors, we can instead handle it via the control flow similar to opcodes.
-            // In the OS implementation, the trap routines would have been saved in the memory locs and trap
-            // vector would have been used to get the routine's memory addr.
-            switch (trap_code) {
-                case TRAP_GETC:
-                {
-                    // read a single char from the keyboard and store it in R0
-                    registers[R_R0] = (uint16_t)getchar();
-                    update_cond_flag(R_R0);
-                    break;
-                }
-                case TRAP_OUT:
-                {
-                    // write a single char to the console
-                    putc((char)registers[R_R0], stdout);
-                    fflush(stdout);
-                    break;
-                }
-                case TRAP_PUTS:
-                {   
-                    // write a word string (ASCII chars) to the console, starting addr
-                    // is stored in R0, writing terminates when NULL (x0000) char is encountered
-                    // NOTE: one char per memory location (16bits or 2B)
-                    uint16_t* str_ptr = memory + registers[R_R0];
-                    while (*str_ptr) {
-                        putc((char)*str_ptr, stdout);
-                        ++str_ptr;
-                    }
-                    fflush(stdout);
-                    break;
-                }
-                case TRAP_IN:
-                {
-                    // show a prompt, read a single char from the keyboard and store it in R0 and also write to console
-                    cout << "Enter a character";
-                    char ch = getchar();
-                    putc(ch, stdout);
-                    fflush(stdout);
-                    registers[R_R0] = (uint16_t)ch;
-                    update_cond_flag(R_R0);
-                    break;
-                }
-                case TRAP_PUTSP:
-                {
-                    // write a byte string to the console, starting addr is stored in R0
-                    // Note: Here there are 2 chars per memory location, so each char per Byte.
-                    // We need to split the 16bit word into 2 bytes and write them to console
-                    uint16_t* str_ptr = memory + registers[R_R0];
-                    while(str_ptr) {
-                        char ch1 = (*str_ptr) & 0xFF; // 1st Byte
-                        char ch2 = (*str_ptr) >> 8; // 2nd Byte
-                        putc(ch1, stdout);
-                        // in case of only single char, 2nd byte will be 0
-                        if (ch2)
-                            putc(ch2, stdout);
-                        ++str_ptr;
-                    }
-                    fflush(stdout);
-                    break;
-                }
-                case TRAP_HALT:
-                {
-                    cout << "Program Halted" << endl;
-                    run = false;
-                    break;
-                }
-                default:
-                break;
-            }
+            run = execute_trap(instruction, run);
             break;
         }
         default:
@@ -522,39 +1249,5547 @@ bool eval_instruction(uint16_t instruction, uint16_t opcode, bool run) {
     return run;
 }
 
-int main(int argc, const char* argv[]) {
-    if (argc < 2) {
-        cout << "Usage: lc3 <image-file>\n";
-        exit(2); 
-    }
-    if (!load_image(argv[1])) {
-        cout << "LC3 image load failed\n";
-        exit(1);
-    }
-
-    // register the interrupt handler
-    signal(SIGINT, interrupt_handler);
-    // prepare the terminal
-    disable_input_buffering();
+#pragma region Dispatch engine
 
-    registers[R_COND] = FL_ZRO; // reset the condition flag
-    registers[R_PC] = 0x3000; // start at the default 0x3000 mem addr
+// The classic switch based loop funnels every instruction through a single indirect
+// branch (the jump table of the switch), so the host branch predictor has to guess the
+// next handler from one shared history and mispredicts a lot.
+// With GCC/Clang labels-as-values ("computed goto") every handler ends with its own
+// indirect jump to the next handler, which gives the predictor a separate history per
+// opcode (eg the BR after an ADD in a loop body becomes very predictable).
+// Compile with -DLC3_SWITCH_DISPATCH to force the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LC3_SWITCH_DISPATCH)
+#define LC3_COMPUTED_GOTO 1
+#else
+#define LC3_COMPUTED_GOTO 0
+#endif
 
-    cout << "Booting up LC-3 Virtual Machine..." << endl;
-    bool run = true;
-
-    // Instruction cycle control loop
-    while(run) {
-        // Instruction cycle: fetch, decode, execute
-
-        // fetch the instr pointed by PC
-        uint16_t instruction = memory_read(registers[R_PC]++);
-        // decode
-        uint16_t opcode = instruction >> 12; // first 4 bits is opcode
-        // execute
-        run = eval_instruction(instruction, opcode, run);
-    }
+// Extracts the operands of an instruction once, so that the handlers don't have to
+// shift, mask and sign extend the same word every time it gets executed.
+void decode_instruction(uint16_t instruction, DecodedInstruction& d) {
+    d.imm2 = 0;
+    d.a = (instruction >> 9) & 0x7;
+    d.b = (instruction >> 6) & 0x7;
+    d.c = instruction & 0x7;
+    d.imm = 0;
 
-    restore_input_buffering();
+    switch (instruction >> 12) {
+        case OP_ADD:
+        case OP_AND:
+        {
+            bool imm_mode = (instruction >> 5) & 0x1;
+            if (imm_mode)
+                d.imm = sign_extend_bits(5, instruction & 0x1F);
+            if (instruction >> 12 == OP_ADD)
+                d.op = imm_mode ? UOP_ADD_IMM : UOP_ADD;
+            else
+                d.op = imm_mode ? UOP_AND_IMM : UOP_AND;
+            break;
+        }
+        case OP_BR:
+            d.imm = sign_extend_bits(9, instruction & 0x1FF);
+            if (d.a == 0)
+                d.op = UOP_NOP; // no condition bit set, never taken
+            else if (d.a == (FL_NEG | FL_ZRO | FL_POS))
+                d.op = UOP_BR_ALWAYS;
+            else
+                d.op = UOP_BR;
+            break;
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            d.imm = sign_extend_bits(9, instruction & 0x1FF);
+            switch (instruction >> 12) {
+                case OP_LD: d.op = UOP_LD; break;
+                case OP_LDI: d.op = UOP_LDI; break;
+                case OP_LEA: d.op = UOP_LEA; break;
+                case OP_ST: d.op = UOP_ST; break;
+                default: d.op = UOP_STI; break;
+            }
+            break;
+        case OP_LDR:
+        case OP_STR:
+            d.imm = sign_extend_bits(6, instruction & 0x3F);
+            d.op = (instruction >> 12 == OP_LDR) ? UOP_LDR : UOP_STR;
+            break;
+        case OP_NOT:
+            d.op = UOP_NOT;
+            break;
+        case OP_JMP:
+            d.op = UOP_JMP;
+            break;
+        case OP_JSR:
+            if ((instruction >> 11) & 0x1) {
+                d.imm = sign_extend_bits(11, instruction & 0x7FF);
+                d.op = UOP_JSR;
+            }
+            else {
+                d.op = UOP_JSRR;
+            }
+            break;
+        case OP_TRAP:
+            d.imm = instruction & 0xFF;
+            d.op = UOP_TRAP;
+            break;
+        default: // OP_RTI, OP_RES
+            d.op = UOP_NOP;
+            break;
+    }
+}
+
+// Superinstructions: fixed sequences which LC-3 code uses over and over (picked from the
+// --pair-histogram of real programs) run as a single handler, which saves the dispatch
+// of the following instructions. Only the slot of the 1st instruction of a sequence gets
+// the fused micro-op, the other words are decoded on their own when executed, so a branch
+// into the middle of a sequence runs the plain handlers. A write to any word of the
+// sequence drops the fused slot (see ram_write).
+void fuse_instructions(const uint16_t* memory, uint16_t address, DecodedInstruction& d) {
+    DecodedInstruction next;
+    decode_instruction(memory[(uint16_t)(address + 1)], next);
+    switch (d.op) {
+        case UOP_AND_IMM:
+            // load constant: AND R, x, #0; ADD R, R, #imm -> R = imm
+            if (d.imm == 0 && next.op == UOP_ADD_IMM && next.a == d.a && next.b == d.a) {
+                d.op = UOP_LOAD_CONST;
+                d.imm = next.imm;
+            }
+            break;
+        case UOP_ADD_IMM:
+            // loop counter: ADD R, x, #imm; BR target
+            if (next.op == UOP_BR) {
+                d.op = UOP_ADD_IMM_BR;
+                d.c = next.a; // nzp
+                d.imm2 = address + 2 + next.imm; // branch target
+            }
+            break;
+        case UOP_ADD:
+            // compare: ADD R, x, y; BR target
+            if (next.op == UOP_BR) {
+                d.op = UOP_ADD_BR;
+                d.imm = next.a; // nzp
+                d.imm2 = address + 2 + next.imm; // branch target
+            }
+            break;
+        case UOP_LDR:
+        {
+            // read-modify-write: LDR R, B, #o; ADD R, R, #imm; STR R, B, #o -> mem[B + o] += imm
+            // (B can't be R, the LDR would change the address of the STR)
+            if (d.a == d.b || next.op != UOP_ADD_IMM || next.a != d.a || next.b != d.a)
+                break;
+            DecodedInstruction third;
+            decode_instruction(memory[(uint16_t)(address + 2)], third);
+            if (third.op == UOP_STR && third.a == d.a && third.b == d.b && third.imm == d.imm) {
+                d.op = UOP_LDR_ADD_STR;
+                d.imm2 = next.imm;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// run_decoded calls the hooks of its Monitor on the way, so that eg an instruction budget
+// or the fuzzer's coverage can be checked without slowing down plain runs: every hook is
+// behind Monitor::ACTIVE, which is a compile time constant, so with NoMonitor they compile
+// away. The other monitors derive from NoMonitor and hide the hooks they use.
+struct NoMonitor {
+    static const bool ACTIVE = false;
+    // called before the instruction at pc is dispatched, false stops the run with PC at pc
+    bool dispatch(uint16_t) { return true; }
+    // a superinstruction is about to run extra instructions after the one dispatched,
+    // false makes it run only its 1st instruction
+    bool run_fused(int) { return true; }
+    // the BR/JMP/JSR at from continued at to (a branch which isn't taken too)
+    void edge(uint16_t, uint16_t) {}
+    // an instruction the handlers don't see: fetched from a device page and run by
+    // eval_instruction, or a UOP_NOP (RTI, RES, a BR with no condition bit)
+    void evaluated(uint16_t, uint16_t, uint16_t) {}
+};
+
+// Stops the run once the machine's instruction budget is used up (see set_budget)
+struct BudgetMonitor : NoMonitor {
+    static const bool ACTIVE = true;
+    LC3Machine& machine;
+
+    explicit BudgetMonitor(LC3Machine& machine) : machine(machine) {}
+
+    bool dispatch(uint16_t) {
+        if (machine.budget_left <= 0) {
+            machine.budget_exhausted = true;
+            return false;
+        }
+        --machine.budget_left;
+        return true;
+    }
+
+    bool run_fused(int extra) {
+        if (machine.budget_left < extra)
+            return false;
+        machine.budget_left -= extra;
+        return true;
+    }
+};
+
+// Runs the instruction cycle over the decoded instruction cache until the program halts.
+// Semantics of each handler are the same as the corresponding case in eval_instruction.
+// The same handlers are used for both the threaded and the switch dispatch, only the
+// way of jumping to the next handler differs.
+template <class Monitor>
+void LC3Machine::run_decoded(Monitor& monitor) {
+#if LC3_COMPUTED_GOTO
+    // handler for each micro-op, in MicroOp order
+    static void* const dispatch_table[UOP_COUNT] = {
+        &&L_UOP_DECODE, &&L_UOP_BR, &&L_UOP_BR_ALWAYS, &&L_UOP_ADD, &&L_UOP_ADD_IMM,
+        &&L_UOP_AND, &&L_UOP_AND_IMM, &&L_UOP_NOT, &&L_UOP_LD, &&L_UOP_LDI, &&L_UOP_LDR,
+        &&L_UOP_LEA, &&L_UOP_ST, &&L_UOP_STI, &&L_UOP_STR, &&L_UOP_JMP, &&L_UOP_JSR,
+        &&L_UOP_JSRR, &&L_UOP_TRAP, &&L_UOP_NOP, &&L_UOP_BREAK, &&L_UOP_LOAD_CONST,
+        &&L_UOP_ADD_IMM_BR, &&L_UOP_ADD_BR, &&L_UOP_LDR_ADD_STR
+    };
+#define HANDLER(uop) L_##uop:
+#define DISPATCH() goto *dispatch_table[d->op]
+#else
+#define HANDLER(uop) case uop:
+#define DISPATCH() goto dispatch
+#endif
+// fetch the decoded instr pointed by PC and jump to its handler
+#define NEXT() \
+    do { \
+        if (Monitor::ACTIVE && !monitor.dispatch(pc)) { \
+            registers[R_PC] = pc; \
+            return; \
+        } \
+        d = &decoded[pc++]; \
+        DISPATCH(); \
+    } while (0)
+// after a load or store which reached a device, the device might have asked to halt (see
+// request_halt). Only the device path looks at the flag, RAM accesses don't pay for it.
+#define STOP_IF_HALT_REQUESTED(reached_device) \
+    do { \
+        if ((reached_device) && halt_requested) { \
+            registers[R_PC] = pc; \
+            return; \
+        } \
+    } while (0)
+// control transfer of the instruction offset words after the slot's one, pc is where it went
+#define EDGE(offset) \
+    do { \
+        if (Monitor::ACTIVE) \
+            monitor.edge((uint16_t)(d - decoded + (offset)), pc); \
+    } while (0)
+// a superinstruction which runs extra instructions after the 1st one
+#define FUSED(extra) \
+    do { \
+        if (Monitor::ACTIVE && !monitor.run_fused(extra)) \
+            goto unfused; \
+    } while (0)
+
+    DecodedInstruction* d;
+    // PC lives in a local (host register) while running, it is written back to
+    // registers[R_PC] only around the calls that need to see it
+    uint16_t pc = registers[R_PC];
+    NEXT();
+
+#if !LC3_COMPUTED_GOTO
+dispatch:
+    switch (d->op) {
+#endif
+    HANDLER(UOP_DECODE)
+        if (is_device_page(pc - 1)) {
+            // an instruction on a device page is fetched through the device every time, like
+            // eval_instruction's loop does, it is never decoded (see map_device)
+            registers[R_PC] = pc - 1;
+            if (breakpoint_count && is_breakpoint(pc - 1)) {
+                paused = PAUSE_BREAKPOINT;
+                return;
+            }
+            uint16_t instruction = memory_read(registers[R_PC]++);
+            bool run = eval_instruction(instruction, instruction >> 12, true);
+            if (Monitor::ACTIVE)
+                monitor.evaluated(pc - 1, instruction, registers[R_PC]);
+            if (!run || halt_requested)
+                return;
+            pc = registers[R_PC];
+            NEXT();
+        }
+        // 1st execution of this address, PC has already moved past it
+        decode_instruction(memory[(uint16_t)(pc - 1)], *d);
+        // superinstructions don't run into a device page
+        if (!is_device_page(pc + 1))
+            fuse_instructions(memory, pc - 1, *d);
+        if (breakpoint_count)
+            apply_breakpoints(pc - 1, *d);
+        DISPATCH();
+    HANDLER(UOP_ADD)
+        cond_result = registers[d->a] = registers[d->b] + registers[d->c];
+        NEXT();
+    HANDLER(UOP_ADD_IMM)
+        cond_result = registers[d->a] = registers[d->b] + d->imm;
+        NEXT();
+    HANDLER(UOP_AND)
+        cond_result = registers[d->a] = registers[d->b] & registers[d->c];
+        NEXT();
+    HANDLER(UOP_AND_IMM)
+        cond_result = registers[d->a] = registers[d->b] & d->imm;
+        NEXT();
+    HANDLER(UOP_NOT)
+        cond_result = registers[d->a] = ~registers[d->b];
+        NEXT();
+    HANDLER(UOP_BR)
+        if (d->a & cond_flag_of(cond_result))
+            pc += d->imm;
+        EDGE(0);
+        NEXT();
+    HANDLER(UOP_BR_ALWAYS)
+        pc += d->imm;
+        EDGE(0);
+        NEXT();
+    HANDLER(UOP_JMP)
+        pc = registers[d->b];
+        EDGE(0);
+        NEXT();
+    HANDLER(UOP_JSR)
+        registers[R_R7] = pc;
+        pc += d->imm;
+        EDGE(0);
+        NEXT();
+    HANDLER(UOP_JSRR)
+        {
+            // read the base register before R7 is overwritten (JSRR R7)
+            uint16_t base = registers[d->b];
+            registers[R_R7] = pc;
+            pc = base;
+        }
+        EDGE(0);
+        NEXT();
+    HANDLER(UOP_LD)
+        {
+            uint16_t address = pc + d->imm;
+            cond_result = registers[d->a] = memory_read(address);
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_LDI)
+        {
+            uint16_t pointer = pc + d->imm;
+            uint16_t address = memory_read(pointer);
+            cond_result = registers[d->a] = memory_read(address);
+            STOP_IF_HALT_REQUESTED(is_device_page(pointer) || is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_LDR)
+        {
+            uint16_t address = registers[d->b] + d->imm;
+            cond_result = registers[d->a] = memory_read(address);
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_LEA)
+        cond_result = registers[d->a] = pc + d->imm;
+        NEXT();
+    HANDLER(UOP_ST)
+        {
+            uint16_t address = pc + d->imm;
+            memory_write(registers[d->a], address);
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_STI)
+        {
+            uint16_t pointer = pc + d->imm;
+            uint16_t address = memory_read(pointer);
+            memory_write(registers[d->a], address);
+            STOP_IF_HALT_REQUESTED(is_device_page(pointer) || is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_STR)
+        {
+            uint16_t address = registers[d->b] + d->imm;
+            memory_write(registers[d->a], address);
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+        }
+        NEXT();
+    HANDLER(UOP_TRAP)
+        registers[R_PC] = pc;
+        if (!execute_trap((OP_TRAP << 12) | d->imm, true))
+            return;
+        pc = registers[R_PC];
+        NEXT();
+    HANDLER(UOP_NOP)
+        // unused / reserved opcodes, see eval_instruction
+        if (Monitor::ACTIVE)
+            monitor.evaluated(pc - 1, memory[(uint16_t)(pc - 1)], pc);
+        NEXT();
+    HANDLER(UOP_BREAK)
+        // see set_breakpoint, the instruction at pc - 1 didn't run
+        registers[R_PC] = pc - 1;
+        paused = PAUSE_BREAKPOINT;
+        return;
+    HANDLER(UOP_LOAD_CONST)
+        FUSED(1);
+        cond_result = registers[d->a] = d->imm;
+        pc += 1;
+        NEXT();
+    HANDLER(UOP_ADD_IMM_BR)
+        FUSED(1);
+        cond_result = registers[d->a] = registers[d->b] + d->imm;
+        pc += 1;
+        if (d->c & cond_flag_of(cond_result))
+            pc = d->imm2;
+        EDGE(1);
+        NEXT();
+    HANDLER(UOP_ADD_BR)
+        FUSED(1);
+        cond_result = registers[d->a] = registers[d->b] + registers[d->c];
+        pc += 1;
+        if (d->imm & cond_flag_of(cond_result))
+            pc = d->imm2;
+        EDGE(1);
+        NEXT();
+    HANDLER(UOP_LDR_ADD_STR)
+        FUSED(2);
+        {
+            uint16_t address = registers[d->b] + d->imm;
+            cond_result = registers[d->a] = memory_read(address);
+            // the ADD and STR don't run if the LDR read a device which asked to halt
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+            cond_result = registers[d->a] += d->imm2;
+            pc += 2;
+            memory_write(registers[d->a], address);
+            STOP_IF_HALT_REQUESTED(is_device_page(address));
+        }
+        NEXT();
+    unfused:
+        // the monitor didn't let a superinstruction run whole, the word of the slot is
+        // still its 1st instruction (an ADD, AND or LDR) and runs on its own
+        registers[R_PC] = pc;
+        eval_instruction(memory[(uint16_t)(pc - 1)], memory[(uint16_t)(pc - 1)] >> 12, true);
+        pc = registers[R_PC];
+        NEXT();
+#if !LC3_COMPUTED_GOTO
+        default:
+            abort();
+    }
+#endif
+
+#undef FUSED
+#undef EDGE
+#undef STOP_IF_HALT_REQUESTED
+#undef NEXT
+#undef DISPATCH
+#undef HANDLER
+}
+
+void LC3Machine::run_decoded() {
+    if (budgeted) {
+        BudgetMonitor monitor(*this);
+        run_decoded(monitor);
+    }
+    else {
+        NoMonitor monitor;
+        run_decoded(monitor);
+    }
+}
+
+#pragma endregion Dispatch engine
+
+#pragma region Disassembler
+
+const char* trap_name(uint16_t trap_code) {
+    switch (trap_code) {
+        case TRAP_GETC: return "GETC";
+        case TRAP_OUT: return "OUT";
+        case TRAP_PUTS: return "PUTS";
+        case TRAP_IN: return "IN";
+        case TRAP_PUTSP: return "PUTSP";
+        case TRAP_HALT: return "HALT";
+        default: return nullptr;
+    }
+}
+
+// Writers for the disassembler, each appends to out and returns the new end. They are
+// used instead of printf so that the trace dump can format millions of lines per second.
+inline char* put_text(char* out, const char* text) {
+    while (*text)
+        *out++ = *text++;
+    return out;
+}
+
+inline char* put_register(char* out, int reg) {
+    *out++ = 'R';
+    *out++ = '0' + reg;
+    return out;
+}
+
+// x and digits hex digits, upper case
+inline char* put_hex(char* out, uint16_t value, int digits = 4) {
+    *out++ = 'x';
+    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+        *out++ = "0123456789ABCDEF"[(value >> shift) & 0xF];
+    return out;
+}
+
+inline char* put_unsigned(char* out, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count)
+        *out++ = digits[--count];
+    return out;
+}
+
+// #value
+inline char* put_immediate(char* out, int value) {
+    *out++ = '#';
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+    return put_unsigned(out, value);
+}
+
+// LC-3 assembly for the instruction at address, PC relative operands are shown as the
+// absolute address they refer to. Writes at most 32 chars (no terminating 0), returns the end.
+char* disassemble_to(char* out, uint16_t address, uint16_t instruction) {
+    uint16_t next_pc = address + 1;
+    int a = (instruction >> 9) & 0x7;
+    int b = (instruction >> 6) & 0x7;
+    const OpcodeInfo& info = OPCODES[instruction >> 12];
+
+    switch (info.format) {
+        case FMT_ALU:
+            out = put_text(out, info.name);
+            *out++ = ' ';
+            out = put_register(out, a);
+            out = put_text(out, ", ");
+            out = put_register(out, b);
+            out = put_text(out, ", ");
+            if ((instruction >> 5) & 0x1)
+                return put_immediate(out, (int16_t)sign_extend_bits(5, instruction & 0x1F));
+            return put_register(out, instruction & 0x7);
+        case FMT_NOT:
+            out = put_register(put_text(out, "NOT "), a);
+            return put_register(put_text(out, ", "), b);
+        case FMT_BR:
+            if (a == 0)
+                return put_text(out, "NOP");
+            out = put_text(out, "BR");
+            if (a & FL_NEG)
+                *out++ = 'n';
+            if (a & FL_ZRO)
+                *out++ = 'z';
+            if (a & FL_POS)
+                *out++ = 'p';
+            *out++ = ' ';
+            return put_hex(out, next_pc + sign_extend_bits(9, instruction & 0x1FF));
+        case FMT_JMP:
+            if (b == R_R7)
+                return put_text(out, "RET");
+            return put_register(put_text(out, "JMP "), b);
+        case FMT_JSR:
+            if ((instruction >> 11) & 0x1)
+                return put_hex(put_text(out, "JSR "), next_pc + sign_extend_bits(11, instruction & 0x7FF));
+            return put_register(put_text(out, "JSRR "), b);
+        case FMT_PC_RELATIVE:
+            out = put_text(out, info.name);
+            *out++ = ' ';
+            out = put_register(out, a);
+            return put_hex(put_text(out, ", "), next_pc + sign_extend_bits(9, instruction & 0x1FF));
+        case FMT_BASE_OFFSET:
+            out = put_text(out, info.name);
+            *out++ = ' ';
+            out = put_register(out, a);
+            out = put_register(put_text(out, ", "), b);
+            return put_immediate(put_text(out, ", "), (int16_t)sign_extend_bits(6, instruction & 0x3F));
+        case FMT_TRAP:
+            if (trap_name(instruction & 0xFF))
+                return put_text(out, trap_name(instruction & 0xFF));
+            return put_hex(put_text(out, "TRAP "), instruction & 0xFF, 2);
+        default: // RTI, RES
+            return put_text(out, info.name);
+    }
+}
+
+string disassemble(uint16_t address, uint16_t instruction) {
+    char text[48];
+    return string(text, disassemble_to(text, address, instruction));
+}
+
+#pragma endregion Disassembler
+
+#pragma region Assembler
+
+// Two pass assembler, produces the same .obj images as the usual LC-3 toolchain: the origin
+// followed by the words, big-endian.
+//
+//   ./lc3 --assemble prog.asm prog.obj
+//   ./lc3 [options] prog.asm        # assembles in memory and runs the result
+//
+// A line is "[label[:]] [mnemonic operands] [; comment]". The mnemonics are the opcodes of enum
+// Opcode (BR[n][z][p], JMP/RET, JSR/JSRR, RTI, and NOP for the branch which is never taken), the
+// trap aliases of enum TrapCode and .ORIG/.FILL/.BLKW/.STRINGZ/.END. Numbers are x1F, #-5 or plain
+// decimal, a PC relative operand is a label or the offset itself. Mnemonics and registers are
+// case-insensitive, labels aren't. Pass 1 only gives the labels their addresses, both passes scan
+// the source in place without copying it into per line strings.
+
+enum AsmKind : uint8_t {
+    ASM_ALU, // ADD/AND DR, SR1, SR2/imm5
+    ASM_NOT, // NOT DR, SR
+    ASM_BR, // BRnzp label
+    ASM_JMP, // JMP BaseR, JSRR BaseR
+    ASM_JSR, // JSR label
+    ASM_PC_RELATIVE, // LD/LDI/LEA/ST/STI R, label
+    ASM_BASE_OFFSET, // LDR/STR R, BaseR, offset6
+    ASM_TRAP, // TRAP trapvect8
+    ASM_FIXED, // no operands (RET, RTI, NOP, trap aliases)
+    ASM_ORIG,
+    ASM_FILL,
+    ASM_BLKW,
+    ASM_STRINGZ,
+    ASM_END,
+};
+
+struct AsmMnemonic {
+    const char* name;
+    AsmKind kind;
+    uint16_t bits; // the instruction without its operands
+};
+
+const AsmMnemonic ASM_MNEMONICS[] = {
+    { "ADD", ASM_ALU, OP_ADD << 12 }, { "AND", ASM_ALU, OP_AND << 12 }, { "NOT", ASM_NOT, OP_NOT << 12 | 0x3F },
+    { "BR", ASM_BR, OP_BR << 12 | (FL_NEG | FL_ZRO | FL_POS) << 9 },
+    { "BRN", ASM_BR, OP_BR << 12 | FL_NEG << 9 }, { "BRZ", ASM_BR, OP_BR << 12 | FL_ZRO << 9 },
+    { "BRP", ASM_BR, OP_BR << 12 | FL_POS << 9 }, { "BRNZ", ASM_BR, OP_BR << 12 | (FL_NEG | FL_ZRO) << 9 },
+    { "BRNP", ASM_BR, OP_BR << 12 | (FL_NEG | FL_POS) << 9 }, { "BRZP", ASM_BR, OP_BR << 12 | (FL_ZRO | FL_POS) << 9 },
+    { "BRNZP", ASM_BR, OP_BR << 12 | (FL_NEG | FL_ZRO | FL_POS) << 9 }, { "NOP", ASM_FIXED, OP_BR << 12 },
+    { "JMP", ASM_JMP, OP_JMP << 12 }, { "RET", ASM_FIXED, OP_JMP << 12 | R_R7 << 6 },
+    { "JSR", ASM_JSR, OP_JSR << 12 | 1 << 11 }, { "JSRR", ASM_JMP, OP_JSR << 12 },
+    { "LD", ASM_PC_RELATIVE, OP_LD << 12 }, { "LDI", ASM_PC_RELATIVE, OP_LDI << 12 },
+    { "LEA", ASM_PC_RELATIVE, OP_LEA << 12 }, { "ST", ASM_PC_RELATIVE, OP_ST << 12 },
+    { "STI", ASM_PC_RELATIVE, OP_STI << 12 }, { "LDR", ASM_BASE_OFFSET, OP_LDR << 12 },
+    { "STR", ASM_BASE_OFFSET, OP_STR << 12 }, { "RTI", ASM_FIXED, OP_RTI << 12 },
+    { "TRAP", ASM_TRAP, OP_TRAP << 12 },
+    { "GETC", ASM_FIXED, OP_TRAP << 12 | TRAP_GETC }, { "OUT", ASM_FIXED, OP_TRAP << 12 | TRAP_OUT },
+    { "PUTS", ASM_FIXED, OP_TRAP << 12 | TRAP_PUTS }, { "IN", ASM_FIXED, OP_TRAP << 12 | TRAP_IN },
+    { "PUTSP", ASM_FIXED, OP_TRAP << 12 | TRAP_PUTSP }, { "HALT", ASM_FIXED, OP_TRAP << 12 | TRAP_HALT },
+    { ".ORIG", ASM_ORIG, 0 }, { ".FILL", ASM_FILL, 0 }, { ".BLKW", ASM_BLKW, 0 },
+    { ".STRINGZ", ASM_STRINGZ, 0 }, { ".END", ASM_END, 0 },
+};
+
+struct AsmToken {
+    const char* text = nullptr;
+    size_t size = 0;
+};
+
+// one source line, split up
+struct AsmLine {
+    AsmToken label;
+    const AsmMnemonic* mnemonic = nullptr;
+    AsmToken operands[3];
+    int operand_count = 0;
+};
+
+class Assembler {
+public:
+    // image gets the origin followed by the words (host byte order), errors one line per
+    // problem. false if there were any.
+    bool assemble(const char* source, size_t size, vector<uint16_t>& image, string& errors);
+
+private:
+    // false (with an error) if the line can't be split up, parses up to the end of the line
+    bool parse_line(AsmLine& line);
+    bool next_token(AsmToken& token);
+    const AsmMnemonic* find_mnemonic(const AsmToken& token) const;
+    void error(const char* format, ...);
+
+    bool parse_number(const AsmToken& token, int32_t& value) const;
+    bool parse_register(const AsmToken& token, uint16_t& reg);
+    bool parse_immediate(const AsmToken& token, int bits, uint16_t& field);
+    bool parse_offset(const AsmToken& token, int bits, uint16_t& field);
+    bool parse_string(const AsmToken& token, string& text);
+    uint16_t encode(const AsmLine& line);
+
+    const char* position = nullptr;
+    const char* end = nullptr;
+    int line_number = 0;
+    uint16_t address = 0; // of the line being assembled
+    int error_count = 0;
+    string* errors = nullptr;
+    unordered_map<string, uint16_t> labels;
+    // the mnemonic names packed into integers, see find_mnemonic
+    uint64_t mnemonic_keys[sizeof(ASM_MNEMONICS) / sizeof(ASM_MNEMONICS[0])] = {};
+};
+
+// the text of a token of up to 8 chars, upper case, as an integer (0 for a longer one)
+inline uint64_t pack_upper(const char* text, size_t size) {
+    if (size > 8)
+        return 0;
+    uint64_t key = 0;
+    for (size_t i = 0; i < size; ++i)
+        key |= (uint64_t)(uint8_t)toupper((unsigned char)text[i]) << (8 * i);
+    return key;
+}
+
+void Assembler::error(const char* format, ...) {
+    // after this many the rest are likely follow ups
+    if (++error_count > 20)
+        return;
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    *errors += "line " + to_string(line_number) + ": " + message + "\n";
+}
+
+inline bool is_separator(char ch) {
+    return ch == ' ' || ch == '\t' || ch == ',' || ch == '\r' || ch == '\n' || ch == ';';
+}
+
+bool Assembler::next_token(AsmToken& token) {
+    while (position < end && (*position == ' ' || *position == '\t' || *position == ',' || *position == '\r'))
+        ++position;
+    if (position == end || *position == '\n' || *position == ';')
+        return false;
+    const char* start = position;
+    if (*position == '"') {
+        // string up to the closing quote, escapes included
+        for (++position; position < end && *position != '"' && *position != '\n'; ++position) {
+            if (*position == '\\' && position + 1 < end && position[1] != '\n')
+                ++position;
+        }
+        if (position < end && *position == '"')
+            ++position;
+    }
+    else {
+        while (position < end && !is_separator(*position))
+            ++position;
+    }
+    token.text = start;
+    token.size = position - start;
+    return true;
+}
+
+const AsmMnemonic* Assembler::find_mnemonic(const AsmToken& token) const {
+    uint64_t key = pack_upper(token.text, token.size);
+    if (!key)
+        return nullptr;
+    for (size_t i = 0; i < sizeof(ASM_MNEMONICS) / sizeof(ASM_MNEMONICS[0]); ++i) {
+        if (mnemonic_keys[i] == key)
+            return &ASM_MNEMONICS[i];
+    }
+    return nullptr;
+}
+
+bool Assembler::parse_line(AsmLine& line) {
+    line = AsmLine();
+    AsmToken token;
+    bool ok = true;
+    if (next_token(token)) {
+        line.mnemonic = find_mnemonic(token);
+        if (!line.mnemonic) {
+            line.label = token;
+            if (token.text[token.size - 1] == ':')
+                --line.label.size;
+            if (next_token(token)) {
+                line.mnemonic = find_mnemonic(token);
+                if (!line.mnemonic) {
+                    error("unknown instruction '%.*s' after label '%.*s'", (int)token.size, token.text,
+                        (int)line.label.size, line.label.text);
+                    ok = false;
+                }
+            }
+        }
+        while (ok && line.mnemonic && next_token(token)) {
+            if (line.operand_count == 3) {
+                error("too many operands");
+                ok = false;
+                break;
+            }
+            line.operands[line.operand_count++] = token;
+        }
+    }
+    // skip the rest (comment, or what came after an error)
+    const char* newline = (const char*)memchr(position, '\n', end - position);
+    position = newline ? newline + 1 : end;
+    return ok;
+}
+
+bool Assembler::parse_number(const AsmToken& token, int32_t& value) const {
+    const char* text = token.text;
+    size_t size = token.size;
+    int base = 10;
+    if (size > 1 && (*text == 'x' || *text == 'X')) {
+        base = 16;
+        ++text;
+        --size;
+    }
+    else if (size > 1 && *text == '#') {
+        ++text;
+        --size;
+    }
+    bool negative = *text == '-';
+    if (negative || *text == '+') {
+        ++text;
+        --size;
+    }
+    if (size == 0 || size > 8)
+        return false;
+    int32_t result = 0;
+    for (size_t i = 0; i < size; ++i) {
+        int digit;
+        char ch = text[i];
+        if (ch >= '0' && ch <= '9')
+            digit = ch - '0';
+        else if (base == 16 && ch >= 'a' && ch <= 'f')
+            digit = ch - 'a' + 10;
+        else if (base == 16 && ch >= 'A' && ch <= 'F')
+            digit = ch - 'A' + 10;
+        else
+            return false;
+        result = result * base + digit;
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+bool Assembler::parse_register(const AsmToken& token, uint16_t& reg) {
+    if (token.size == 2 && (token.text[0] == 'R' || token.text[0] == 'r') && token.text[1] >= '0' && token.text[1] <= '7') {
+        reg = token.text[1] - '0';
+        return true;
+    }
+    error("expected a register, got '%.*s'", (int)token.size, token.text);
+    return false;
+}
+
+// a number which fits into a bits wide signed field
+bool Assembler::parse_immediate(const AsmToken& token, int bits, uint16_t& field) {
+    int32_t value;
+    if (!parse_number(token, value)) {
+        error("expected a number, got '%.*s'", (int)token.size, token.text);
+        return false;
+    }
+    if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1))) {
+        error("%d doesn't fit into %d bits", value, bits);
+        return false;
+    }
+    field = value & ((1 << bits) - 1);
+    return true;
+}
+
+// a label (relative to the next instruction) or the offset itself
+bool Assembler::parse_offset(const AsmToken& token, int bits, uint16_t& field) {
+    int32_t value;
+    if (!parse_number(token, value)) {
+        auto label = labels.find(string(token.text, token.size));
+        if (label == labels.end()) {
+            error("unknown label '%.*s'", (int)token.size, token.text);
+            return false;
+        }
+        value = (int16_t)(label->second - (uint16_t)(address + 1));
+    }
+    if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1))) {
+        error("'%.*s' is out of range, offset %d doesn't fit into %d bits", (int)token.size, token.text, value, bits);
+        return false;
+    }
+    field = value & ((1 << bits) - 1);
+    return true;
+}
+
+bool Assembler::parse_string(const AsmToken& token, string& text) {
+    if (token.size < 2 || token.text[0] != '"' || token.text[token.size - 1] != '"') {
+        error("expected a string in quotes");
+        return false;
+    }
+    text.clear();
+    for (size_t i = 1; i + 1 < token.size; ++i) {
+        char ch = token.text[i];
+        if (ch == '\\') {
+            switch (token.text[++i]) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'e': ch = 27; break;
+                case '0': ch = 0; break;
+                default: ch = token.text[i]; break; // \" and \\ (and anything else as is)
+            }
+        }
+        text += ch;
+    }
+    return true;
+}
+
+// the instruction of the line, errors leave the fields 0
+uint16_t Assembler::encode(const AsmLine& line) {
+    static const int OPERAND_COUNTS[] = { 3, 2, 1, 1, 1, 2, 3, 1, 0 };
+    const AsmMnemonic& mnemonic = *line.mnemonic;
+    if (line.operand_count != OPERAND_COUNTS[mnemonic.kind]) {
+        error("%s takes %d operands", mnemonic.name, OPERAND_COUNTS[mnemonic.kind]);
+        return mnemonic.bits;
+    }
+    const AsmToken* operands = line.operands;
+    uint16_t a = 0, b = 0, c = 0;
+    switch (mnemonic.kind) {
+        case ASM_ALU:
+            parse_register(operands[0], a) && parse_register(operands[1], b);
+            if (operands[2].size == 2 && (operands[2].text[0] == 'R' || operands[2].text[0] == 'r'))
+                parse_register(operands[2], c);
+            else if (parse_immediate(operands[2], 5, c))
+                c |= 1 << 5;
+            return mnemonic.bits | a << 9 | b << 6 | c;
+        case ASM_NOT:
+            parse_register(operands[0], a) && parse_register(operands[1], b);
+            return mnemonic.bits | a << 9 | b << 6;
+        case ASM_BR:
+            parse_offset(operands[0], 9, c);
+            return mnemonic.bits | c;
+        case ASM_JMP:
+            parse_register(operands[0], b);
+            return mnemonic.bits | b << 6;
+        case ASM_JSR:
+            parse_offset(operands[0], 11, c);
+            return mnemonic.bits | c;
+        case ASM_PC_RELATIVE:
+            parse_register(operands[0], a) && parse_offset(operands[1], 9, c);
+            return mnemonic.bits | a << 9 | c;
+        case ASM_BASE_OFFSET:
+            parse_register(operands[0], a) && parse_register(operands[1], b) && parse_immediate(operands[2], 6, c);
+            return mnemonic.bits | a << 9 | b << 6 | c;
+        case ASM_TRAP:
+        {
+            int32_t vector;
+            if (!parse_number(operands[0], vector) || vector < 0 || vector > 0xFF)
+                error("expected a trap vector (x00-xFF), got '%.*s'", (int)operands[0].size, operands[0].text);
+            else
+                c = vector;
+            return mnemonic.bits | c;
+        }
+        default:
+            return mnemonic.bits;
+    }
+}
+
+bool Assembler::assemble(const char* source, size_t size, vector<uint16_t>& image, string& error_text) {
+    for (size_t i = 0; i < sizeof(ASM_MNEMONICS) / sizeof(ASM_MNEMONICS[0]); ++i)
+        mnemonic_keys[i] = pack_upper(ASM_MNEMONICS[i].name, strlen(ASM_MNEMONICS[i].name));
+    errors = &error_text;
+    error_count = 0;
+    labels.clear();
+    image.clear();
+    AsmLine line;
+    string text;
+
+    for (int pass = 1; pass <= 2; ++pass) {
+        position = source;
+        end = source + size;
+        line_number = 0;
+        bool started = false;
+        uint32_t next = 0; // address of the next word, can go one past the memory
+        while (position < end) {
+            ++line_number;
+            if (!parse_line(line))
+                continue;
+            AsmKind kind = line.mnemonic ? line.mnemonic->kind : ASM_FIXED;
+            if (kind == ASM_END)
+                break;
+            if (kind == ASM_ORIG) {
+                int32_t origin;
+                if (started) {
+                    error("only one .ORIG per image");
+                    break;
+                }
+                if (line.operand_count != 1 || !parse_number(line.operands[0], origin) || origin < 0 || origin >= MEMORY_MAX) {
+                    error(".ORIG takes an address");
+                    break;
+                }
+                started = true;
+                next = origin;
+                if (pass == 2)
+                    image.push_back(origin);
+                continue;
+            }
+            if (!started) {
+                if (line.label.size || line.mnemonic)
+                    error("code before .ORIG");
+                if (line.mnemonic)
+                    break;
+                continue;
+            }
+            address = next;
+
+            if (pass == 1 && line.label.size) {
+                if (!labels.emplace(string(line.label.text, line.label.size), address).second)
+                    error("label '%.*s' defined twice", (int)line.label.size, line.label.text);
+            }
+            if (!line.mnemonic)
+                continue;
+
+            // words of the line
+            size_t words = 1;
+            if (kind == ASM_BLKW || kind == ASM_FILL || kind == ASM_STRINGZ) {
+                if (line.operand_count != 1) {
+                    error("%s takes 1 operand", line.mnemonic->name);
+                    continue;
+                }
+            }
+            if (kind == ASM_BLKW) {
+                int32_t count;
+                if (!parse_number(line.operands[0], count) || count < 0) {
+                    error(".BLKW takes a word count");
+                    continue;
+                }
+                words = count;
+                if (pass == 2)
+                    image.insert(image.end(), words, 0);
+            }
+            else if (kind == ASM_STRINGZ) {
+                if (!parse_string(line.operands[0], text))
+                    continue;
+                words = text.size() + 1;
+                if (pass == 2) {
+                    for (char ch : text)
+                        image.push_back((uint8_t)ch);
+                    image.push_back(0);
+                }
+            }
+            else if (kind == ASM_FILL) {
+                if (pass == 2) {
+                    int32_t value;
+                    uint16_t word = 0;
+                    if (parse_number(line.operands[0], value)) {
+                        if (value < -0x8000 || value > 0xFFFF)
+                            error("%d doesn't fit into a word", value);
+                        word = value;
+                    }
+                    else {
+                        auto label = labels.find(string(line.operands[0].text, line.operands[0].size));
+                        if (label == labels.end())
+                            error("unknown label '%.*s'", (int)line.operands[0].size, line.operands[0].text);
+                        else
+                            word = label->second;
+                    }
+                    image.push_back(word);
+                }
+            }
+            else if (pass == 2) {
+                image.push_back(encode(line));
+            }
+            next += words;
+            if (next > MEMORY_MAX) {
+                error("the image doesn't fit into the memory");
+                break;
+            }
+        }
+        if (pass == 1 && !started && !error_count) {
+            error_text += "no .ORIG\n";
+            ++error_count;
+        }
+        if (error_count)
+            break;
+    }
+    if (error_count > 20)
+        error_text += to_string(error_count - 20) + " more errors\n";
+    return error_count == 0;
+}
+
+// assembles the file at path, errors are printed with the path
+bool assemble_file(const char* path, vector<uint16_t>& image) {
+    string source;
+    if (!read_whole_file(path, source)) {
+        cout << "Failed to read " << path << endl;
+        return false;
+    }
+    Assembler assembler;
+    string errors;
+    if (!assembler.assemble(source.data(), source.size(), image, errors)) {
+        size_t start = 0;
+        for (size_t newline; (newline = errors.find('\n', start)) != string::npos; start = newline + 1)
+            cout << path << ": " << errors.substr(start, newline + 1 - start);
+        return false;
+    }
+    return true;
+}
+
+// writes image (see Assembler::assemble) as a .obj file
+bool write_image_file(const char* path, const vector<uint16_t>& image) {
+    vector<uint16_t> words(image.size());
+    for (size_t i = 0; i < image.size(); ++i)
+        words[i] = swap_byte_layout16(image[i]);
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(words.data(), sizeof(uint16_t), words.size(), file) == words.size();
+    return fclose(file) == 0 && ok;
+}
+
+#pragma endregion Assembler
+
+#pragma region Instrumentation
+
+// Tools which have to look at every executed instruction (profiler, pair histogram) run the
+// program through this loop, one instruction at a time with eval_instruction. Hooks is a
+// policy class with
+//   void before(uint16_t pc, uint16_t instruction); // instruction at pc is about to run
+//   void after(uint16_t pc, uint16_t instruction, uint16_t next_pc); // it ran, PC is next_pc
+// The loop is instantiated per tool, so the hooks get inlined and the normal dispatch loops
+// (run_decoded, run_jit) don't pay anything for the instrumentation.
+template <class Hooks>
+void run_instrumented(LC3Machine& machine, Hooks& hooks) {
+    bool run = true;
+    while (run && !machine.halt_requested) {
+        uint16_t pc = machine.registers[R_PC];
+        uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+        hooks.before(pc, instruction);
+        run = machine.eval_instruction(instruction, instruction >> 12, run);
+        hooks.after(pc, instruction, machine.registers[R_PC]);
+    }
+}
+
+// Runs at most budget instructions, returns the no. of instructions executed, which is
+// less than budget if the program halted. Used to stop a program at a given point,
+// eg to snapshot it once it is past its initialization.
+uint64_t run_for(LC3Machine& machine, uint64_t budget) {
+    uint64_t executed = 0;
+    bool run = true;
+    while (run && executed < budget && !machine.halt_requested) {
+        uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+        run = machine.eval_instruction(instruction, instruction >> 12, run);
+        ++executed;
+    }
+    return executed;
+}
+
+// true for the instructions which end a basic block
+inline bool is_control_transfer(uint16_t instruction) {
+    uint16_t opcode = instruction >> 12;
+    return opcode == OP_BR || opcode == OP_JMP || opcode == OP_JSR;
+}
+
+// indexes of the non zero counts, highest count first, at most top of them
+template <class Counts>
+vector<size_t> top_counts(const Counts& counts, size_t size, size_t top) {
+    vector<size_t> order;
+    for (size_t i = 0; i < size; ++i)
+        if (counts[i])
+            order.push_back(i);
+    sort(order.begin(), order.end(), [&](size_t x, size_t y) { return counts[x] > counts[y]; });
+    if (order.size() > top)
+        order.resize(top);
+    return order;
+}
+
+// Counts which micro-op (before fusion) follows which, the most common pairs are the
+// candidates for superinstructions:
+//   ./lc3 --pair-histogram <image-file>
+struct PairHistogramHooks {
+    vector<uint64_t> pairs = vector<uint64_t>(UOP_COUNT * UOP_COUNT, 0);
+    uint64_t executed = 0;
+    int previous = UOP_NOP;
+
+    void before(uint16_t, uint16_t instruction) {
+        DecodedInstruction d;
+        decode_instruction(instruction, d);
+        ++pairs[previous * UOP_COUNT + d.op];
+        previous = d.op;
+        ++executed;
+    }
+    void after(uint16_t, uint16_t, uint16_t) {}
+
+    void report(size_t top) const {
+        printf("Micro-op pair histogram, %llu instructions:\n", (unsigned long long)executed);
+        for (size_t pair : top_counts(pairs, pairs.size(), top)) {
+            printf("  %-10s -> %-10s %14llu  %5.1f%%\n", UOP_NAMES[pair / UOP_COUNT], UOP_NAMES[pair % UOP_COUNT],
+                (unsigned long long)pairs[pair], 100.0 * pairs[pair] / executed);
+        }
+    }
+};
+
+// Execution profile: counts per opcode, per trap code and per PC, and the edges between
+// the basic blocks as executed (a block starts at the target of a control transfer and
+// ends with the next BR/JMP/JSR, edges are keyed by the start of the source block).
+//   ./lc3 --profile [--top N] <image-file>
+struct ProfileHooks {
+    uint64_t opcodes[16] = {};
+    uint64_t traps[256] = {};
+    vector<uint64_t> pcs = vector<uint64_t>(MEMORY_MAX, 0);
+    unordered_map<uint32_t, uint64_t> edges; // (block start << 16 | target) -> count
+    uint64_t executed = 0;
+    uint16_t block_start;
+
+    explicit ProfileHooks(uint16_t entry) : block_start(entry) {}
+
+    void before(uint16_t pc, uint16_t instruction) {
+        ++opcodes[instruction >> 12];
+        ++pcs[pc];
+        if ((instruction >> 12) == OP_TRAP)
+            ++traps[instruction & 0xFF];
+        ++executed;
+    }
+
+    void after(uint16_t, uint16_t instruction, uint16_t next_pc) {
+        if (is_control_transfer(instruction)) {
+            ++edges[(uint32_t)block_start << 16 | next_pc];
+            block_start = next_pc;
+        }
+    }
+
+    void report(const LC3Machine& machine, size_t top) const {
+        printf("\nProfile, %llu instructions\n", (unsigned long long)executed);
+
+        printf("\nOpcodes:\n");
+        for (size_t op : top_counts(opcodes, 16, 16))
+            printf("  %-6s %14llu  %5.1f%%\n", OPCODES[op].name, (unsigned long long)opcodes[op],
+                100.0 * opcodes[op] / executed);
+
+        printf("\nTraps:\n");
+        for (size_t code : top_counts(traps, 256, 256)) {
+            const char* name = trap_name(code);
+            printf("  x%02zX %-6s %14llu\n", code, name ? name : "", (unsigned long long)traps[code]);
+        }
+
+        printf("\nHot addresses:\n");
+        for (size_t pc : top_counts(pcs, pcs.size(), top))
+            printf("  x%04zX %14llu  %5.1f%%  %s\n", pc, (unsigned long long)pcs[pc], 100.0 * pcs[pc] / executed,
+                disassemble(pc, machine.memory[pc]).c_str());
+
+        vector<pair<uint32_t, uint64_t>> sorted_edges(edges.begin(), edges.end());
+        sort(sorted_edges.begin(), sorted_edges.end(),
+            [](const pair<uint32_t, uint64_t>& x, const pair<uint32_t, uint64_t>& y) { return x.second > y.second; });
+        if (sorted_edges.size() > top)
+            sorted_edges.resize(top);
+        printf("\nBlock edges:\n");
+        for (const auto& edge : sorted_edges)
+            printf("  x%04X -> x%04X %14llu\n", edge.first >> 16, edge.first & 0xFFFF, (unsigned long long)edge.second);
+    }
+};
+
+#pragma endregion Instrumentation
+
+#pragma region Breakpoints and watchpoints
+
+// Breakpoints and watchpoints for the normal engines, which don't check anything per instruction:
+//  - a breakpoint is a bit the decoder looks at when it fills a slot, the slot of the address
+//    gets UOP_BREAK, which stops run_decoded before the instruction. Setting one only drops the
+//    slots (and JIT blocks) covering the address, the next execution decodes it again. The JIT
+//    ends its blocks before breakpoints and its dispatcher checks the bit before running an
+//    address it has no block for.
+//  - a watched address has its page mapped to the watch device, which passes every access on
+//    to the page's own device (or RAM) and pauses the run on the watched ones (request_pause).
+//    Only the accesses to that page take the device path. Its instructions are fetched through
+//    the watch device as well (on every engine), so they run on the slow path and a read watch
+//    on an instruction stops the run when it is fetched.
+// Without breakpoints or watchpoints nothing of this runs. The JIT checks for a pause after
+// every access which took the device path, so a compiled block stops right after a watched
+// load or store, like the interpreter.
+//
+//   ./lc3 [--jit] [--break <addr>]... [--watch <addr>]... [--rwatch <addr>]... <image-file>
+
+const uint8_t WATCH_READ = 1 << 0;
+const uint8_t WATCH_WRITE = 1 << 1;
+
+struct Watchpoints {
+    uint8_t flags[MEMORY_MAX] = {}; // WATCH_* per address
+    uint16_t watched[PAGE_COUNT] = {}; // no. of watched addresses in the page
+    Device* page_devices[PAGE_COUNT] = {}; // device of the watched pages before, nullptr for RAM
+
+    // the access which paused the run
+    uint16_t address = 0;
+    uint16_t old_value = 0;
+    uint16_t value = 0;
+    bool write = false;
+};
+
+uint16_t watch_read(LC3Machine& machine, uint16_t address) {
+    Watchpoints& watch = *machine.watchpoints;
+    Device* device = watch.page_devices[address >> PAGE_SHIFT];
+    uint16_t value = device ? device->read(machine, address) : machine.memory[address];
+    if (watch.flags[address] & WATCH_READ) {
+        watch.address = address;
+        watch.old_value = watch.value = value;
+        watch.write = false;
+        machine.request_pause();
+    }
+    return value;
+}
+
+void watch_write(LC3Machine& machine, uint16_t data, uint16_t address) {
+    Watchpoints& watch = *machine.watchpoints;
+    Device* device = watch.page_devices[address >> PAGE_SHIFT];
+    uint16_t old_value = machine.memory[address];
+    if (device)
+        device->write(machine, data, address);
+    else
+        machine.ram_write(data, address);
+    if (watch.flags[address] & WATCH_WRITE) {
+        watch.address = address;
+        watch.old_value = old_value;
+        watch.value = data;
+        watch.write = true;
+        machine.request_pause();
+    }
+}
+
+Device watch_device = { watch_read, watch_write };
+
+void LC3Machine::apply_breakpoints(uint16_t address, DecodedInstruction& d) {
+    if (is_breakpoint(address)) {
+        d.op = UOP_BREAK;
+    }
+    else if (d.op >= UOP_FIRST_FUSED
+        && (is_breakpoint(address + 1) || (d.op == UOP_LDR_ADD_STR && is_breakpoint(address + 2)))) {
+        // the sequence would run over the breakpoint, use the plain handler
+        decode_instruction(memory[address], d);
+    }
+}
+
+void LC3Machine::set_breakpoint(uint16_t address, bool enabled) {
+    if (is_breakpoint(address) == enabled)
+        return;
+    breakpoints[address >> 6] ^= 1ull << (address & 63);
+    breakpoint_count += enabled ? 1 : -1;
+    // decoded again on the next execution, with (or without) the breakpoint
+    drop_slot(address);
+    if (jit_covered[address])
+        jit_invalidate(address);
+}
+
+void LC3Machine::watch(uint16_t address, uint8_t flags) {
+    if (!watchpoints)
+        watchpoints = new Watchpoints();
+    Watchpoints& watch = *watchpoints;
+    uint16_t page = address >> PAGE_SHIFT;
+    if (flags && !watch.flags[address] && watch.watched[page]++ == 0) {
+        watch.page_devices[page] = page_devices[page];
+        map_device(page, &watch_device);
+    }
+    else if (!flags && watch.flags[address] && --watch.watched[page] == 0) {
+        map_device(page, watch.page_devices[page]);
+    }
+    watch.flags[address] = flags;
+}
+
+// Runs the program on the decoded or the JIT engine, shows where each breakpoint / watchpoint
+// stopped it and continues.
+void run_with_breakpoints(LC3Machine& machine, bool use_jit) {
+    while (true) {
+        if (use_jit)
+            machine.run_jit();
+        else
+            machine.run_decoded();
+        if (!machine.paused)
+            break;
+
+        machine.io->output_flush();
+        uint16_t pc = machine.registers[R_PC];
+        if (machine.paused == PAUSE_WATCHPOINT) {
+            const Watchpoints& watch = *machine.watchpoints;
+            if (watch.write)
+                printf("\nWatchpoint x%04X written: x%04X -> x%04X", watch.address, watch.old_value, watch.value);
+            else
+                printf("\nWatchpoint x%04X read: x%04X", watch.address, watch.value);
+            printf(", next x%04X: %s\n", pc, disassemble(pc, machine.memory[pc]).c_str());
+        }
+        else {
+            printf("\nBreakpoint x%04X: %s\n", pc, disassemble(pc, machine.memory[pc]).c_str());
+        }
+        for (int reg = R_R0; reg <= R_R7; ++reg)
+            printf("R%d x%04X%s", reg, machine.registers[reg], reg == R_R7 ? "\n" : "  ");
+
+        bool at_breakpoint = machine.paused == PAUSE_BREAKPOINT;
+        machine.paused = 0;
+        machine.halt_requested = false;
+        if (at_breakpoint) {
+            // the instruction under the breakpoint runs once outside of the engine
+            uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+            if (!machine.eval_instruction(instruction, instruction >> 12, true) || machine.halt_requested)
+                break;
+        }
+    }
+}
+
+#pragma endregion Breakpoints and watchpoints
+
+#pragma region Snapshots
+
+// A snapshot is the complete state a program continues from: the registers and the memory.
+// The device state is the device registers in memory (KBSR/KBDR), the caches (decoded
+// instructions, JIT blocks) are derived from memory and are rebuilt after a restore.
+// The console is not part of it, a restored machine continues with whatever input it gets.
+//
+// Snapshot file: SnapshotHeader, then the memory at SNAPSHOT_MEMORY_OFFSET in host byte order.
+// It is meant to be restored on the host which saved it, the memory can be copied straight
+// out of the mapped file.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t memory_offset;
+    uint16_t registers[R_COUNT]; // R_COND is synced with the condition flag
+};
+
+const char SNAPSHOT_MAGIC[8] = "LC3SNAP";
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_MEMORY_OFFSET = 64;
+const size_t SNAPSHOT_FILE_SIZE = SNAPSHOT_MEMORY_OFFSET + MEMORY_MAX * sizeof(uint16_t);
+
+void LC3Machine::restore_state(const uint16_t* saved_registers, const uint16_t* saved_memory) {
+    memcpy(registers, saved_registers, sizeof(registers));
+    memcpy(memory, saved_memory, sizeof(memory));
+    set_cond_flag(registers[R_COND]);
+    halt_requested = false;
+    drop_decoded(0, MEMORY_MAX);
+    jit_flush();
+}
+
+bool LC3Machine::save_snapshot(const char* path) {
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.memory_offset = SNAPSHOT_MEMORY_OFFSET;
+    sync_cond_register();
+    memcpy(header.registers, registers, sizeof(registers));
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    char padding[SNAPSHOT_MEMORY_OFFSET] = {};
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(padding, SNAPSHOT_MEMORY_OFFSET - sizeof(header), 1, file) == 1
+        && fwrite(memory, sizeof(memory), 1, file) == 1;
+    return fclose(file) == 0 && written;
+}
+
+// maps the snapshot file at path, nullptr if it can't be read or isn't a snapshot of this
+// version. The mapping is SNAPSHOT_FILE_SIZE long.
+const SnapshotHeader* map_snapshot(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat info;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size == SNAPSHOT_FILE_SIZE)
+        mapped = mmap(nullptr, SNAPSHOT_FILE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return nullptr;
+
+    const SnapshotHeader* header = (const SnapshotHeader*)mapped;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION || header->memory_offset != SNAPSHOT_MEMORY_OFFSET) {
+        munmap(mapped, SNAPSHOT_FILE_SIZE);
+        return nullptr;
+    }
+    return header;
+}
+
+const uint16_t* snapshot_memory(const SnapshotHeader* header) {
+    return (const uint16_t*)((const char*)header + SNAPSHOT_MEMORY_OFFSET);
+}
+
+bool LC3Machine::restore_snapshot(const char* path) {
+    const SnapshotHeader* header = map_snapshot(path);
+    if (!header)
+        return false;
+    restore_state(header->registers, snapshot_memory(header));
+    munmap((void*)header, SNAPSHOT_FILE_SIZE);
+    return true;
+}
+
+// reads a snapshot file into state, eg to fork machines from it
+bool read_snapshot(const char* path, MachineState& state) {
+    const SnapshotHeader* header = map_snapshot(path);
+    if (!header)
+        return false;
+    memcpy(state.registers, header->registers, sizeof(state.registers));
+    memcpy(state.memory, snapshot_memory(header), sizeof(state.memory));
+    munmap((void*)header, SNAPSHOT_FILE_SIZE);
+    return true;
+}
+
+// A machine forked from a state starts as a full copy of it. Every write to memory goes
+// through ram_write (including the device writes, the JIT and the translated code), which
+// marks the page as dirty, so the pages which are still clean are known to be equal to the
+// base and resetting the machine only copies the dirty ones back. A run which touches a few
+// pages resets in a few microseconds instead of copying all the memory and dropping all
+// the decoded instructions and JIT blocks.
+void LC3Machine::fork_from(const MachineState& base) {
+    restore_state(base.registers, base.memory);
+    fork_base = &base;
+    dirty_pages = 0;
+}
+
+void LC3Machine::reset() {
+    for (size_t page = 0; page < DIRTY_PAGE_COUNT; ++page) {
+        if (!(dirty_pages >> page & 1))
+            continue;
+        size_t first = page << DIRTY_PAGE_SHIFT;
+        memcpy(memory + first, fork_base->memory + first, DIRTY_PAGE_SIZE * sizeof(uint16_t));
+        drop_decoded(first, DIRTY_PAGE_SIZE);
+        if (jit) {
+            for (size_t address = first; address < first + DIRTY_PAGE_SIZE; ++address)
+                if (jit_covered[address])
+                    jit_invalidate(address);
+        }
+    }
+    dirty_pages = 0;
+
+    memcpy(registers, fork_base->registers, sizeof(registers));
+    set_cond_flag(registers[R_COND]);
+    halt_requested = false;
+}
+
+#pragma endregion Snapshots
+
+#pragma region Record and replay
+
+// The only thing which makes two runs of an image differ is the keyboard: which byte a
+// program reads, and for a program which polls KBSR (eg 2048), at which poll a key shows up.
+// --record logs every input event of a terminal run, --replay feeds the log back instead of
+// the terminal, so the run is repeated exactly, eg to reproduce a bug or to time 2048 with
+// the same moves every time.
+//
+// The clock of the log is the number of input_available() calls (KBSR polls) rather than
+// the instruction count: between two input events the program is deterministic, so the
+// polls happen at the same points of the run in both, and counting them costs nothing in
+// the dispatch loop, the JIT or the translated code.
+//
+// Log file: RecordingHeader, then one event per input_read(), as two LEB128 varints:
+//   (polls since the previous event << 1) | 1 if the read followed a poll which returned true
+//   the byte, 256 for EOF
+struct RecordingHeader {
+    char magic[8];
+    uint32_t version;
+};
+
+const char RECORDING_MAGIC[8] = "LC3REC";
+const uint32_t RECORDING_VERSION = 1;
+const int RECORDED_EOF = 256;
+
+void write_varint(FILE* file, uint64_t value) {
+    uint8_t bytes[10];
+    size_t count = 0;
+    do {
+        bytes[count] = value & 0x7F;
+        value >>= 7;
+        if (value)
+            bytes[count] |= 0x80;
+        ++count;
+    } while (value);
+    fwrite(bytes, 1, count, file);
+}
+
+// false at the end of the data (or on a truncated varint)
+bool read_varint(const char*& data, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; data < end && shift < 64; shift += 7) {
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Passes the console through to another one (the terminal) and logs its input
+class RecordIO : public LC3IO {
+public:
+    RecordIO(LC3IO* console, FILE* log) : console(console), log(log) {
+        RecordingHeader header = {};
+        memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+        header.version = RECORDING_VERSION;
+        fwrite(&header, sizeof(header), 1, log);
+        fflush(log);
+    }
+
+    bool input_available() override {
+        ++polls;
+        polled = console->input_available();
+        return polled;
+    }
+
+    int input_read() override {
+        int ch = console->input_read();
+        write_varint(log, (polls - event_polls) << 1 | (polled ? 1 : 0));
+        write_varint(log, ch == EOF ? RECORDED_EOF : (unsigned char)ch);
+        // input is rare, flushing every event keeps the log complete if the run is killed
+        fflush(log);
+        event_polls = polls;
+        polled = false;
+        ++events;
+        return ch;
+    }
+
+    bool halt_at_end_of_input() override {
+        return console->halt_at_end_of_input();
+    }
+
+    uint64_t events = 0;
+
+protected:
+    void write_output(const char* data, size_t size) override {
+        for (size_t i = 0; i < size; ++i)
+            console->output_char(data[i]);
+        console->output_flush();
+    }
+
+private:
+    LC3IO* console;
+    FILE* log;
+    uint64_t polls = 0;
+    uint64_t event_polls = 0; // polls at the previous event
+    bool polled = false; // the last poll returned true and no read followed yet
+};
+
+// Console which plays a recorded log back: a poll returns true exactly when it did in the
+// recorded run and the reads return the recorded bytes. Past the end of the log it behaves
+// like the end of a script, so the program halts at its next read.
+class ReplayIO : public ScriptIO {
+public:
+    explicit ReplayIO(FILE* out) : ScriptIO(nullptr, 0, out) {}
+
+    // false if the file can't be read or isn't a recording
+    bool load(const char* path) {
+        string data;
+        if (!read_whole_file(path, data) || data.size() < sizeof(RecordingHeader))
+            return false;
+        RecordingHeader header;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORDING_VERSION)
+            return false;
+
+        const char* next = data.data() + sizeof(header);
+        const char* end = data.data() + data.size();
+        uint64_t poll = 0, delta, byte;
+        while (read_varint(next, end, delta) && read_varint(next, end, byte)) {
+            poll += delta >> 1;
+            events.push_back({ poll, (delta & 1) != 0, byte == RECORDED_EOF ? EOF : (int)byte });
+        }
+        return true;
+    }
+
+    bool input_available() override {
+        ++polls;
+        if (next_event == events.size())
+            return ScriptIO::input_available();
+        const InputEvent& event = events[next_event];
+        return event.polled && event.poll == polls;
+    }
+
+    int input_read() override {
+        if (next_event == events.size())
+            return ScriptIO::input_read();
+        return events[next_event++].byte;
+    }
+
+    bool halt_at_end_of_input() override {
+        // a recorded EOF goes to the program like it did in the recorded run
+        return input_ended;
+    }
+
+    size_t events_replayed() const {
+        return next_event;
+    }
+
+    size_t events_recorded() const {
+        return events.size();
+    }
+
+private:
+    struct InputEvent {
+        uint64_t poll;
+        bool polled;
+        int byte;
+    };
+
+    vector<InputEvent> events;
+    size_t next_event = 0;
+    uint64_t polls = 0;
+};
+
+#pragma endregion Record and replay
+
+#pragma region JIT compiler
+
+// Hot code is translated to native x86-64, one LC-3 basic block at a time. A block starts
+// at the PC the dispatcher is at and runs until (and including) the first BR/JMP/JSR, it
+// stops before TRAP/RTI/RES which are always left to the interpreter.
+// Inside a block the LC-3 registers R0-R7 are held in the host registers r8-r15, they are
+// loaded when the block is entered and written back to registers[] when it exits.
+// Block calling convention (SysV): void block(uint16_t* registers, uint16_t* memory),
+// which are kept in rbx and rbp while the block runs.
+#if defined(__x86_64__) && defined(__linux__)
+#define LC3_JIT_SUPPORTED 1
+#else
+#define LC3_JIT_SUPPORTED 0
+#endif
+
+#if LC3_JIT_SUPPORTED
+const int JIT_MAX_BLOCK = 64; // max no. of LC-3 instructions in a block
+const uint16_t JIT_HOT_THRESHOLD = 8; // times a PC is interpreted before it gets compiled
+const size_t JIT_BUFFER_SIZE = 16 << 20; // executable memory for the compiled blocks
+const size_t JIT_MAX_BLOCK_CODE = 16 << 10; // upper bound of the native code of one block
+
+typedef void (*JitBlockFn)(uint16_t* regs, uint16_t* mem);
+
+// JIT tier of one machine, the compiled code has the addresses of that machine's
+// state baked in so nothing here is shared between machines
+struct JitState {
+    // entry point of the block compiled for each start address, nullptr if none
+    uint8_t* code[MEMORY_MAX];
+    // one past the last address covered by the block starting at each address
+    uint16_t block_end[MEMORY_MAX];
+    // no. of times each PC was reached by the interpreter, used to detect hot code
+    uint16_t hotness[MEMORY_MAX];
+
+    uint8_t* buffer;
+    size_t buffer_used;
+};
+
+// x86-64 host registers
+enum HostReg {
+    H_RAX = 0, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI,
+    H_R8, H_R9, H_R10, H_R11, H_R12, H_R13, H_R14, H_R15
+};
+
+// host register holding the LC-3 general purpose register
+inline int host_reg(int lc3_reg) {
+    return H_R8 + lc3_reg;
+}
+
+// Minimal x86-64 machine code emitter, only the instruction forms used by the block compiler.
+// The LC-3 registers are 16 bits wide so most operations use the 16bit operand size (0x66 prefix),
+// which gives the wrap-around behaviour for free.
+struct JitEmitter {
+    uint8_t* code;
+    size_t size;
+
+    void byte(uint8_t b) { code[size++] = b; }
+    void u16(uint16_t v) { memcpy(code + size, &v, 2); size += 2; }
+    void u32(uint32_t v) { memcpy(code + size, &v, 4); size += 4; }
+    void u64(uint64_t v) { memcpy(code + size, &v, 8); size += 8; }
+
+    // REX prefix, only emitted when one of the extended registers (r8-r15) or 64bit size is used
+    void rex(bool w, int reg, int base) {
+        uint8_t r = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+        if (r != 0x40)
+            byte(r);
+    }
+    void modrm_reg(int reg, int rm) { byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+    // [base + disp32], base must not be rsp/r12 (would need a SIB byte)
+    void modrm_disp32(int reg, int base, int32_t disp) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        u32(disp);
+    }
+
+    // <op> dst16, src16 for the reg/reg forms of add (01), and (21), mov (89), test (85)
+    void op_rr16(uint8_t opcode, int dst, int src) {
+        byte(0x66); rex(false, src, dst); byte(opcode); modrm_reg(src, dst);
+    }
+    // add (/0) or and (/4) dst16, imm16
+    void op_ri16(int ext, int dst, uint16_t imm) {
+        byte(0x66); rex(false, 0, dst); byte(0x81); modrm_reg(ext, dst); u16(imm);
+    }
+    void not16(int dst) { byte(0x66); rex(false, 0, dst); byte(0xF7); modrm_reg(2, dst); }
+    void mov_ri16(int dst, uint16_t imm) { byte(0x66); rex(false, 0, dst); byte(0xB8 + (dst & 7)); u16(imm); }
+    void mov_ri32(int dst, uint32_t imm) { rex(false, 0, dst); byte(0xB8 + (dst & 7)); u32(imm); }
+    // movzx dst32, src16
+    void movzx_rr(int dst, int src) { rex(false, dst, src); byte(0x0F); byte(0xB7); modrm_reg(dst, src); }
+    // movzx dst32, word [base + disp32]
+    void movzx_load(int dst, int base, int32_t disp) {
+        rex(false, dst, base); byte(0x0F); byte(0xB7); modrm_disp32(dst, base, disp);
+    }
+    // movzx dst32, word [rbp + rax*2]
+    void movzx_load_indexed(int dst) {
+        rex(false, dst, 0); byte(0x0F); byte(0xB7);
+        byte(0x44 | ((dst & 7) << 3)); // mod=01, rm=100 (SIB)
+        byte(0x45); // scale=2, index=rax, base=rbp
+        byte(0x00); // disp8
+    }
+    // mov word [base + disp32], src16
+    void store16(int base, int32_t disp, int src) {
+        byte(0x66); rex(false, src, base); byte(0x89); modrm_disp32(src, base, disp);
+    }
+    // mov word [base + disp32], imm16
+    void store_imm16(int base, int32_t disp, uint16_t imm) {
+        byte(0x66); rex(false, 0, base); byte(0xC7); modrm_disp32(0, base, disp); u16(imm);
+    }
+    void push(int reg) { rex(false, 0, reg); byte(0x50 + (reg & 7)); }
+    void pop(int reg) { rex(false, 0, reg); byte(0x58 + (reg & 7)); }
+
+    // jmp/jcc rel32, returns the position of the rel32 field so that it can be patched
+    size_t jmp32() { byte(0xE9); u32(0); return size - 4; }
+    size_t jcc32(uint8_t cc) { byte(0x0F); byte(0x80 | cc); u32(0); return size - 4; }
+    void patch(size_t field, size_t target) {
+        int32_t rel = (int32_t)(target - (field + 4));
+        memcpy(code + field, &rel, 4);
+    }
+};
+
+// x86 condition codes used with jcc32, the lowest bit inverts the condition
+const uint8_t CC_Z = 0x4, CC_NZ = 0x5;
+// condition under which a BR is taken after "test result, result", indexed by nzp
+// n: js, z: je, p: jg, nz: jle, zp: jns, np: jne
+const uint8_t BR_TAKEN_CC[8] = { 0, 0xF, 0x4, 0x9, 0x8, 0x5, 0xE, 0 };
+
+// Helpers called from the generated code for the accesses which can't be done inline
+uint32_t jit_load_helper(LC3Machine* machine, uint32_t address) {
+    return machine->memory_read(address);
+}
+
+// returns non zero if the write invalidated compiled code, the block then has to exit
+// as it might have just overwritten itself, or if it hit a device which asked to halt
+// (eg a watchpoint, which has to stop right after the store)
+uint32_t jit_store_helper(LC3Machine* machine, uint32_t data, uint32_t address) {
+    bool hit_code = machine->jit_covered[(uint16_t)address] != 0;
+    machine->memory_write(data, address);
+    return hit_code | machine->halt_requested;
+}
+
+// Compiles the basic block starting at start_pc
+struct JitBlockCompiler {
+    LC3Machine& machine;
+    JitEmitter e;
+    uint16_t start_pc;
+    // one past the last address of the block and the address of the instruction being compiled
+    uint16_t end;
+    uint16_t current;
+    // LC-3 register (host reg) holding the last result the condition flag is derived from,
+    // -1 if the copy of cond_result in the stack slot at [rsp] is up to date
+    int flag_reg;
+    // rel32 fields of the jumps to the epilogue
+    size_t exits[2 * JIT_MAX_BLOCK + 4];
+    int exit_count;
+
+    explicit JitBlockCompiler(LC3Machine& machine) : machine(machine) {}
+
+    // call a helper with the machine as the 1st argument (the others are set up in esi, edx),
+    // r8-r11 (R0-R3) are caller saved so they are preserved around the call.
+    // The stack is 16 byte aligned at this point (see prologue).
+    void call_helper(void* fn) {
+        e.push(H_R8); e.push(H_R9); e.push(H_R10); e.push(H_R11);
+        e.byte(0x48); e.byte(0xBF); e.u64((uint64_t)&machine); // mov rdi, imm64
+        e.byte(0x48); e.byte(0xB8); e.u64((uint64_t)fn); // mov rax, imm64
+        e.byte(0xFF); e.byte(0xD0); // call rax
+        e.pop(H_R11); e.pop(H_R10); e.pop(H_R9); e.pop(H_R8);
+    }
+
+    // the block keeps cond_result in its stack slot, it is copied from/to the global in the
+    // prologue/epilogue. Doesn't change the host flags.
+    void materialize_cond() {
+        if (flag_reg >= 0) {
+            e.byte(0x66); e.rex(false, flag_reg, 0); e.byte(0x89); // mov word [rsp], r16
+            e.byte(0x04 | ((flag_reg & 7) << 3)); e.byte(0x24);
+            flag_reg = -1;
+        }
+    }
+
+    void jump_to_epilogue() {
+        exits[exit_count++] = e.jmp32();
+    }
+
+    // budget_left += amount, changes the host flags
+    void add_budget(int32_t amount) {
+        e.byte(0x48); e.byte(0xB9); e.u64((uint64_t)&machine.budget_left); // mov rcx, imm64
+        e.byte(0x48); e.byte(0x81); e.byte(0x01); e.u32(amount); // add qword [rcx], imm32
+    }
+
+    // leave the block and continue at pc
+    void exit_to(uint16_t pc) {
+        materialize_cond();
+        // the dispatcher charged the whole block to the budget, give back the instructions skipped
+        if (machine.budgeted && end - (current + 1) > 0)
+            add_budget(end - (current + 1));
+        e.store_imm16(H_RBX, R_PC * 2, pc);
+        jump_to_epilogue();
+    }
+
+    // taken branch back to the start of the loop at internal_target
+    void jump_internal(uint16_t internal_target, size_t internal_target_offset) {
+        if (!machine.budgeted) {
+            e.patch(e.jmp32(), internal_target_offset);
+            return;
+        }
+        // charge the next pass from internal_target to the end of the block, if the
+        // budget can't cover it leave the block and let the dispatcher finish the budget
+        add_budget(-(int32_t)(current + 1 - internal_target));
+        e.patch(e.jcc32(0x9), internal_target_offset); // jns
+        add_budget(end - internal_target);
+        e.store_imm16(H_RBX, R_PC * 2, internal_target);
+        jump_to_epilogue();
+    }
+
+    // leaves the block at next_pc if the device access just made asked the machine to halt,
+    // so a loop inside the block can't poll a device forever
+    void exit_if_halt_requested(uint16_t next_pc) {
+        e.byte(0x48); e.byte(0xB9); e.u64((uint64_t)&machine.halt_requested); // mov rcx, imm64
+        e.byte(0x80); e.byte(0x39); e.byte(0x00); // cmp byte [rcx], 0
+        size_t skip = e.jcc32(CC_Z);
+        int saved_flag_reg = flag_reg;
+        exit_to(next_pc);
+        flag_reg = saved_flag_reg; // the side exit doesn't change the state of the main path
+        e.patch(skip, e.size);
+    }
+
+    // dst = memory_read(eax), the last access of the instruction before next_pc
+    void load_dynamic(int dst, uint16_t next_pc) {
+        // device page check
+        e.byte(0x89); e.byte(0xC2); // mov edx, eax
+        e.byte(0xC1); e.byte(0xEA); e.byte(PAGE_SHIFT); // shr edx, PAGE_SHIFT
+        e.byte(0x48); e.byte(0xB9); e.u64((uint64_t)machine.page_devices); // mov rcx, imm64
+        e.byte(0x48); e.byte(0x83); e.byte(0x3C); e.byte(0xD1); e.byte(0x00); // cmp qword [rcx + rdx*8], 0
+        size_t slow = e.jcc32(CC_NZ);
+        e.movzx_load_indexed(dst);
+        size_t done = e.jmp32();
+        e.patch(slow, e.size);
+        e.byte(0x89); e.byte(0xC6); // mov esi, eax
+        call_helper((void*)jit_load_helper);
+        if (dst != H_RAX)
+            e.op_rr16(0x89, dst, H_RAX);
+        // on the way out dst is the result the condition flag comes from
+        int saved_flag_reg = flag_reg;
+        flag_reg = dst;
+        exit_if_halt_requested(next_pc);
+        flag_reg = saved_flag_reg;
+        e.patch(done, e.size);
+    }
+
+    // dst = memory_read(address), address known at compile time
+    void load_const(int dst, uint16_t address) {
+        if (!machine.is_device_page(address)) {
+            e.movzx_load(dst, H_RBP, address * 2);
+        }
+        else {
+            e.mov_ri32(H_RSI, address);
+            call_helper((void*)jit_load_helper);
+            if (dst != H_RAX)
+                e.op_rr16(0x89, dst, H_RAX);
+        }
+    }
+
+    // memory_write(esi, edx), leaves the block if the write hit compiled code
+    void store(uint16_t next_pc) {
+        call_helper((void*)jit_store_helper);
+        e.byte(0x85); e.byte(0xC0); // test eax, eax
+        size_t skip = e.jcc32(CC_Z);
+        int saved_flag_reg = flag_reg;
+        exit_to(next_pc);
+        flag_reg = saved_flag_reg; // the side exit doesn't change the state of the main path
+        e.patch(skip, e.size);
+    }
+
+    // dst = src1 <op> src2 / imm
+    void alu(uint8_t rr_opcode, int imm_ext, uint16_t instruction) {
+        int dr = host_reg((instruction >> 9) & 0x7);
+        int sr1 = host_reg((instruction >> 6) & 0x7);
+        if ((instruction >> 5) & 0x1) {
+            if (dr != sr1)
+                e.op_rr16(0x89, dr, sr1);
+            e.op_ri16(imm_ext, dr, sign_extend_bits(5, instruction & 0x1F));
+        }
+        else {
+            int sr2 = host_reg(instruction & 0x7);
+            if (dr == sr1)
+                e.op_rr16(rr_opcode, dr, sr2);
+            else if (dr == sr2)
+                e.op_rr16(rr_opcode, dr, sr1); // add and and are commutative
+            else {
+                e.op_rr16(0x89, dr, sr1);
+                e.op_rr16(rr_opcode, dr, sr2);
+            }
+        }
+        flag_reg = dr;
+    }
+
+    // returns the entry point of the compiled block, nullptr if there is nothing to compile
+    uint8_t* compile(uint16_t pc) {
+        start_pc = pc;
+        flag_reg = -1;
+        exit_count = 0;
+
+        // pass 1: find the end of the block
+        end = start_pc;
+        bool terminated = false;
+        const uint16_t* memory = machine.memory;
+        while (end < MEMORY_MAX - 1 && !machine.is_device_page(end) && end - start_pc < JIT_MAX_BLOCK) {
+            // the dispatcher stops at breakpoints
+            if (machine.breakpoint_count && machine.is_breakpoint(end))
+                break;
+            uint16_t instruction = memory[end];
+            uint16_t opcode = instruction >> 12;
+            if (opcode == OP_TRAP || opcode == OP_RTI || opcode == OP_RES)
+                break;
+            ++end;
+            if (opcode == OP_JMP || opcode == OP_JSR || (opcode == OP_BR && ((instruction >> 9) & 0x7))) {
+                terminated = true;
+                break;
+            }
+        }
+        if (end == start_pc)
+            return nullptr;
+
+        // a terminating branch back into the block becomes a jump inside the generated code
+        int internal_target = -1;
+        uint16_t last = memory[end - 1];
+        if (terminated && (last >> 12) == OP_BR) {
+            uint16_t target = end + sign_extend_bits(9, last & 0x1FF);
+            if (target >= start_pc && target < end)
+                internal_target = target;
+        }
+        size_t internal_target_offset = 0;
+
+        // pass 2: emit the code
+        JitState& jit = *machine.jit;
+        e.code = jit.buffer + jit.buffer_used;
+        e.size = 0;
+
+        // prologue: save the callee saved registers, 6 pushes + the 8 byte slot for cond_result
+        // keep the stack 16 byte aligned
+        e.push(H_RBX); e.push(H_RBP); e.push(H_R12); e.push(H_R13); e.push(H_R14); e.push(H_R15);
+        e.byte(0x48); e.byte(0x83); e.byte(0xEC); e.byte(0x08); // sub rsp, 8
+        e.byte(0x48); e.byte(0xB8); e.u64((uint64_t)&machine.cond_result); // mov rax, imm64
+        e.byte(0x0F); e.byte(0xB7); e.byte(0x00); // movzx eax, word [rax]
+        e.byte(0x66); e.byte(0x89); e.byte(0x04); e.byte(0x24); // mov word [rsp], ax
+        e.byte(0x48); e.byte(0x89); e.byte(0xFB); // mov rbx, rdi
+        e.byte(0x48); e.byte(0x89); e.byte(0xF5); // mov rbp, rsi
+        for (int r = R_R0; r <= R_R7; ++r)
+            e.movzx_load(host_reg(r), H_RBX, r * 2);
+
+        for (uint16_t addr = start_pc; addr < end; ++addr) {
+            current = addr;
+            if (addr == internal_target) {
+                materialize_cond();
+                internal_target_offset = e.size;
+            }
+
+            uint16_t instruction = memory[addr];
+            uint16_t next_pc = addr + 1;
+            int a = host_reg((instruction >> 9) & 0x7);
+            int b = host_reg((instruction >> 6) & 0x7);
+            switch (instruction >> 12) {
+                case OP_ADD:
+                    alu(0x01, 0, instruction);
+                    break;
+                case OP_AND:
+                    alu(0x21, 4, instruction);
+                    break;
+                case OP_NOT:
+                    if (a != b)
+                        e.op_rr16(0x89, a, b);
+                    e.not16(a);
+                    flag_reg = a;
+                    break;
+                case OP_LEA:
+                    e.mov_ri16(a, next_pc + sign_extend_bits(9, instruction & 0x1FF));
+                    flag_reg = a;
+                    break;
+                case OP_LD:
+                {
+                    uint16_t address = next_pc + sign_extend_bits(9, instruction & 0x1FF);
+                    load_const(a, address);
+                    flag_reg = a;
+                    if (machine.is_device_page(address))
+                        exit_if_halt_requested(next_pc);
+                    break;
+                }
+                case OP_LDI:
+                {
+                    uint16_t address = next_pc + sign_extend_bits(9, instruction & 0x1FF);
+                    load_const(H_RAX, address);
+                    load_dynamic(a, next_pc);
+                    flag_reg = a;
+                    if (machine.is_device_page(address))
+                        exit_if_halt_requested(next_pc);
+                    break;
+                }
+                case OP_LDR:
+                    e.movzx_rr(H_RAX, b);
+                    e.op_ri16(0, H_RAX, sign_extend_bits(6, instruction & 0x3F));
+                    load_dynamic(a, next_pc);
+                    flag_reg = a;
+                    break;
+                case OP_ST:
+                    e.movzx_rr(H_RSI, a);
+                    e.mov_ri32(H_RDX, (uint16_t)(next_pc + sign_extend_bits(9, instruction & 0x1FF)));
+                    store(next_pc);
+                    break;
+                case OP_STI:
+                    load_const(H_RAX, next_pc + sign_extend_bits(9, instruction & 0x1FF));
+                    e.byte(0x89); e.byte(0xC2); // mov edx, eax
+                    e.movzx_rr(H_RSI, a);
+                    store(next_pc);
+                    break;
+                case OP_STR:
+                    e.movzx_rr(H_RDX, b);
+                    e.op_ri16(0, H_RDX, sign_extend_bits(6, instruction & 0x3F));
+                    e.movzx_rr(H_RSI, a);
+                    store(next_pc);
+                    break;
+                case OP_BR:
+                {
+                    uint16_t nzp = (instruction >> 9) & 0x7;
+                    if (nzp == 0)
+                        break; // never taken
+                    uint16_t target = next_pc + sign_extend_bits(9, instruction & 0x1FF);
+                    size_t not_taken = 0;
+                    if (nzp != (FL_NEG | FL_ZRO | FL_POS)) {
+                        // the flag is never computed, the host flags of "test result, result"
+                        // are checked directly with the jcc matching nzp
+                        int result = flag_reg;
+                        if (result < 0) {
+                            e.byte(0x0F); e.byte(0xB7); e.byte(0x04); e.byte(0x24); // movzx eax, word [rsp]
+                            result = H_RAX;
+                        }
+                        e.op_rr16(0x85, result, result); // test
+                        materialize_cond();
+                        not_taken = e.jcc32(BR_TAKEN_CC[nzp] ^ 1);
+                    }
+                    else {
+                        materialize_cond();
+                    }
+                    if (target == internal_target)
+                        jump_internal(target, internal_target_offset);
+                    else
+                        exit_to(target);
+                    if (nzp != (FL_NEG | FL_ZRO | FL_POS)) {
+                        e.patch(not_taken, e.size);
+                        exit_to(next_pc);
+                    }
+                    break;
+                }
+                case OP_JMP:
+                    materialize_cond();
+                    e.movzx_rr(H_RAX, b);
+                    e.store16(H_RBX, R_PC * 2, H_RAX);
+                    jump_to_epilogue();
+                    break;
+                case OP_JSR:
+                    materialize_cond();
+                    if ((instruction >> 11) & 0x1) {
+                        e.mov_ri16(host_reg(R_R7), next_pc);
+                        exit_to(next_pc + sign_extend_bits(11, instruction & 0x7FF));
+                    }
+                    else {
+                        // read the base register before R7 is overwritten (JSRR R7)
+                        e.movzx_rr(H_RAX, b);
+                        e.mov_ri16(host_reg(R_R7), next_pc);
+                        e.store16(H_RBX, R_PC * 2, H_RAX);
+                        jump_to_epilogue();
+                    }
+                    break;
+            }
+        }
+        current = end - 1;
+        if (!terminated)
+            exit_to(end);
+
+        // epilogue: write back the registers and return to the dispatcher
+        size_t epilogue = e.size;
+        for (int i = 0; i < exit_count; ++i)
+            e.patch(exits[i], epilogue);
+        for (int r = R_R0; r <= R_R7; ++r)
+            e.store16(H_RBX, r * 2, host_reg(r));
+        e.byte(0x0F); e.byte(0xB7); e.byte(0x04); e.byte(0x24); // movzx eax, word [rsp]
+        e.byte(0x48); e.byte(0xBA); e.u64((uint64_t)&machine.cond_result); // mov rdx, imm64
+        e.byte(0x66); e.byte(0x89); e.byte(0x02); // mov word [rdx], ax
+        e.byte(0x48); e.byte(0x83); e.byte(0xC4); e.byte(0x08); // add rsp, 8
+        e.pop(H_R15); e.pop(H_R14); e.pop(H_R13); e.pop(H_R12); e.pop(H_RBP); e.pop(H_RBX);
+        e.byte(0xC3); // ret
+
+        jit.buffer_used += e.size;
+        // keep the entry points 16 byte aligned
+        jit.buffer_used = (jit.buffer_used + 15) & ~(size_t)15;
+
+        jit.code[start_pc] = e.code;
+        jit.block_end[start_pc] = end;
+        for (uint16_t addr = start_pc; addr < end; ++addr)
+            ++machine.jit_covered[addr];
+        return e.code;
+    }
+};
+
+uint8_t* jit_compile(LC3Machine& machine, uint16_t pc) {
+    if (machine.jit->buffer_used + JIT_MAX_BLOCK_CODE > JIT_BUFFER_SIZE)
+        machine.jit_flush();
+    JitBlockCompiler compiler(machine);
+    return compiler.compile(pc);
+}
+#endif
+
+bool LC3Machine::jit_init() {
+#if LC3_JIT_SUPPORTED
+    void* buffer = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return false;
+    jit = new JitState();
+    jit->buffer = (uint8_t*)buffer;
+    // blocks compiled from now on are tracked in jit_covered
+    jit_flush();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// drops every compiled block, used when the code buffer is full or when the
+// assumptions compiled into the code (eg which pages are RAM) change
+void LC3Machine::jit_flush() {
+#if LC3_JIT_SUPPORTED
+    if (!jit)
+        return;
+    memset(jit->code, 0, sizeof(jit->code));
+    memset(jit_covered, 0, sizeof(jit_covered));
+    jit->buffer_used = 0;
+#endif
+}
+
+void LC3Machine::jit_invalidate(uint16_t address) {
+#if LC3_JIT_SUPPORTED
+    // blocks are at most JIT_MAX_BLOCK long, so only the ones starting in that window can cover address
+    int first = address - JIT_MAX_BLOCK + 1;
+    for (int start = first < 0 ? 0 : first; start <= address; ++start) {
+        if (jit->code[start] && address < jit->block_end[start]) {
+            jit->code[start] = nullptr;
+            for (int addr = start; addr < jit->block_end[start]; ++addr)
+                --jit_covered[addr];
+        }
+    }
+#endif
+}
+
+// Runs the program with the JIT tier: compiled blocks are executed natively, everything
+// else (cold code, traps) is interpreted one instruction at a time with eval_instruction.
+void LC3Machine::run_jit() {
+#if LC3_JIT_SUPPORTED
+    bool run = true;
+    // a device can ask to halt from a compiled block (see JitBlockCompiler::exit_if_halt_requested)
+    // or from the interpreter
+    while (run && !halt_requested) {
+        uint16_t pc = registers[R_PC];
+        uint8_t* code = jit->code[pc];
+        if (!code) {
+            // no block starts at or runs over a breakpoint (see JitBlockCompiler)
+            if (breakpoint_count && is_breakpoint(pc)) {
+                paused = PAUSE_BREAKPOINT;
+                break;
+            }
+            if (++jit->hotness[pc] >= JIT_HOT_THRESHOLD) {
+                jit->hotness[pc] = 0;
+                code = jit_compile(*this, pc);
+            }
+        }
+        if (code && budgeted && budget_left < jit->block_end[pc] - pc)
+            code = nullptr; // not enough budget left for the whole block, interpret the rest
+        if (code) {
+            // with a budget the whole block is charged up front, its exits give back what they skip
+            if (budgeted)
+                budget_left -= jit->block_end[pc] - pc;
+            ((JitBlockFn)code)(registers, memory);
+            continue;
+        }
+
+        if (budgeted) {
+            if (budget_left <= 0) {
+                budget_exhausted = true;
+                return;
+            }
+            --budget_left;
+        }
+        uint16_t instruction = memory_read(registers[R_PC]++);
+        run = eval_instruction(instruction, instruction >> 12, run);
+    }
+#else
+    run_decoded();
+#endif
+}
+
+LC3Machine::~LC3Machine() {
+    delete watchpoints;
+#if LC3_JIT_SUPPORTED
+    if (jit) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        delete jit;
+    }
+#endif
+}
+
+#pragma endregion JIT compiler
+
+#pragma region AOT translator
+
+// Ahead-of-time translation of a whole image to C++. Every address reachable from the
+// entry point becomes a labeled block of C++ code and the LC-3 registers become locals,
+// so the host compiler can keep them in registers and drop the condition flag updates
+// nobody reads. Targets only known at runtime (JMP/RET/JSRR) go through a switch over the
+// translated addresses, and anything not translated runs in the interpreter.
+//
+//   ./lc3 --translate assets/2048.obj 2048_aot.inc
+//   g++ -O2 -pthread -I. -DLC3_AOT='"2048_aot.inc"' lc3_vm.cpp -o lc3_2048
+//
+// The generated file is included by this one (see below), the resulting binary has the
+// image built in and runs it without taking an image path.
+
+// worklist walk over the control flow starting at entry, reachable[addr] is set for
+// every address which is executed as an instruction
+void find_reachable(const LC3Machine& machine, uint16_t entry, vector<bool>& reachable) {
+    vector<uint16_t> worklist;
+    worklist.push_back(entry);
+    while (!worklist.empty()) {
+        uint16_t addr = worklist.back();
+        worklist.pop_back();
+        if (reachable[addr] || machine.is_device_page(addr))
+            continue;
+        reachable[addr] = true;
+
+        uint16_t instruction = machine.memory[addr];
+        uint16_t next_pc = addr + 1;
+        switch (instruction >> 12) {
+            case OP_BR:
+            {
+                uint16_t nzp = (instruction >> 9) & 0x7;
+                if (nzp)
+                    worklist.push_back(next_pc + sign_extend_bits(9, instruction & 0x1FF));
+                if (nzp != (FL_NEG | FL_ZRO | FL_POS))
+                    worklist.push_back(next_pc);
+                break;
+            }
+            case OP_JMP:
+                break; // target only known at runtime
+            case OP_JSR:
+                if ((instruction >> 11) & 0x1)
+                    worklist.push_back(next_pc + sign_extend_bits(11, instruction & 0x7FF));
+                worklist.push_back(next_pc); // return address
+                break;
+            case OP_TRAP:
+                if ((instruction & 0xFF) != TRAP_HALT)
+                    worklist.push_back(next_pc);
+                break;
+            default:
+                worklist.push_back(next_pc);
+                break;
+        }
+    }
+}
+
+// C++ statement jumping to target: straight to its label if it was translated, else (eg a
+// target on the device registers page) through the dispatch like a runtime target
+void translate_jump(FILE* out, const vector<bool>& reachable, uint16_t target) {
+    if (reachable[target])
+        fprintf(out, "goto L_%04X;", target);
+    else
+        fprintf(out, "{ pc = 0x%04X; goto dispatch; }", target);
+}
+
+// C++ statements for the instruction at addr
+void translate_instruction(const LC3Machine& machine, FILE* out, const vector<bool>& reachable, uint16_t addr, uint16_t instruction) {
+    uint16_t next_pc = addr + 1;
+    int a = (instruction >> 9) & 0x7;
+    int b = (instruction >> 6) & 0x7;
+    uint16_t imm5 = sign_extend_bits(5, instruction & 0x1F);
+    uint16_t offset6 = sign_extend_bits(6, instruction & 0x3F);
+    uint16_t pc_offset9 = next_pc + sign_extend_bits(9, instruction & 0x1FF);
+
+    switch (instruction >> 12) {
+        case OP_ADD:
+        case OP_AND:
+        {
+            char op = (instruction >> 12) == OP_ADD ? '+' : '&';
+            if ((instruction >> 5) & 0x1)
+                fprintf(out, "    r%d = r%d %c 0x%04X; cc = r%d;\n", a, b, op, imm5, a);
+            else
+                fprintf(out, "    r%d = r%d %c r%d; cc = r%d;\n", a, b, op, instruction & 0x7, a);
+            break;
+        }
+        case OP_NOT:
+            fprintf(out, "    r%d = ~r%d; cc = r%d;\n", a, b, a);
+            break;
+        case OP_LEA:
+            fprintf(out, "    r%d = 0x%04X; cc = r%d;\n", a, pc_offset9, a);
+            break;
+        case OP_LD:
+            fprintf(out, "    r%d = m.memory_read(0x%04X); cc = r%d;\n", a, pc_offset9, a);
+            if (machine.is_device_page(pc_offset9))
+                fprintf(out, "    AOT_CHECK_HALT(0x%04X);\n", next_pc);
+            break;
+        case OP_LDI:
+            fprintf(out, "    r%d = m.memory_read(m.memory_read(0x%04X)); cc = r%d;\n", a, pc_offset9, a);
+            fprintf(out, "    AOT_CHECK_HALT(0x%04X);\n", next_pc);
+            break;
+        case OP_LDR:
+            fprintf(out, "    r%d = m.memory_read((uint16_t)(r%d + 0x%04X)); cc = r%d;\n", a, b, offset6, a);
+            fprintf(out, "    AOT_CHECK_HALT(0x%04X);\n", next_pc);
+            break;
+        case OP_ST:
+            fprintf(out, "    AOT_STORE(r%d, 0x%04X, 0x%04X);\n", a, pc_offset9, next_pc);
+            break;
+        case OP_STI:
+            fprintf(out, "    AOT_STORE(r%d, m.memory_read(0x%04X), 0x%04X);\n", a, pc_offset9, next_pc);
+            break;
+        case OP_STR:
+            fprintf(out, "    AOT_STORE(r%d, (uint16_t)(r%d + 0x%04X), 0x%04X);\n", a, b, offset6, next_pc);
+            break;
+        case OP_BR:
+        {
+            uint16_t nzp = (instruction >> 9) & 0x7;
+            if (nzp == (FL_NEG | FL_ZRO | FL_POS))
+                fprintf(out, "    ");
+            else if (nzp)
+                fprintf(out, "    if (cond_flag_of(cc) & %d) ", nzp);
+            else
+                break;
+            translate_jump(out, reachable, pc_offset9);
+            fprintf(out, "\n");
+            break;
+        }
+        case OP_JMP:
+            fprintf(out, "    pc = r%d; goto dispatch;\n", b);
+            break;
+        case OP_JSR:
+            if ((instruction >> 11) & 0x1) {
+                fprintf(out, "    r7 = 0x%04X; ", next_pc);
+                translate_jump(out, reachable, next_pc + sign_extend_bits(11, instruction & 0x7FF));
+                fprintf(out, "\n");
+            }
+            else
+                fprintf(out, "    pc = r%d; r7 = 0x%04X; goto dispatch;\n", b, next_pc);
+            break;
+        case OP_TRAP:
+            fprintf(out, "    AOT_TRAP(0x%04X, 0x%04X);\n", instruction, next_pc);
+            break;
+        default: // OP_RTI, OP_RES: no-op, see eval_instruction
+            break;
+    }
+}
+
+bool translate_image(LC3Machine& machine, const char* image_path, const char* out_path) {
+    const uint16_t* memory = machine.memory;
+    if (machine.load_image(image_path) < 0)
+        return false;
+
+    // find the loaded range again from the image header
+    FILE* img_file = fopen(image_path, "rb");
+    if (!img_file)
+        return false;
+    uint16_t origin = 0;
+    if (fread(&origin, sizeof(uint16_t), 1, img_file) != 1) {
+        fclose(img_file);
+        return false;
+    }
+    origin = swap_byte_layout16(origin);
+    fseek(img_file, 0, SEEK_END);
+    long image_words = ftell(img_file) / 2 - 1;
+    fclose(img_file);
+    FILE* out = fopen(out_path, "w");
+    if (!out)
+        return false;
+    if (image_words > MEMORY_MAX - origin)
+        image_words = MEMORY_MAX - origin;
+
+    const uint16_t entry = 0x3000;
+    vector<bool> reachable(MEMORY_MAX, false);
+    find_reachable(machine, entry, reachable);
+
+    fprintf(out, "// Generated by `lc3 --translate %s`, do not edit.\n", image_path);
+    fprintf(out, "// Build with: g++ -O2 -pthread -I. -DLC3_AOT='\"%s\"' lc3_vm.cpp\n\n", out_path);
+
+    fprintf(out, "const uint16_t aot_origin = 0x%04X;\n", origin);
+    fprintf(out, "const uint16_t aot_entry = 0x%04X;\n", entry);
+    fprintf(out, "const uint16_t aot_image[] = {");
+    for (long i = 0; i < image_words; ++i)
+        fprintf(out, "%s0x%04X,", i % 12 ? " " : "\n    ", memory[(uint16_t)(origin + i)]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "// addresses with translated code\nconst uint16_t aot_translated[] = {");
+    int count = 0;
+    for (int addr = 0; addr < MEMORY_MAX; ++addr)
+        if (reachable[addr])
+            fprintf(out, "%s0x%04X,", count++ % 12 ? " " : "\n    ", addr);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "void run_aot(LC3Machine& m) {\n");
+    fprintf(out, "    AOT_PROLOGUE();\n\n");
+    for (int addr = 0; addr < MEMORY_MAX; ++addr) {
+        if (!reachable[addr])
+            continue;
+        fprintf(out, "L_%04X: // 0x%04X\n", addr, memory[addr]);
+        translate_instruction(machine, out, reachable, addr, memory[addr]);
+        // data or unreachable code follows, don't fall into the next label. After xFFFF the
+        // PC wraps around to x0000, which isn't the next label either.
+        if (addr + 1 == MEMORY_MAX || !reachable[addr + 1])
+            fprintf(out, "    pc = 0x%04X; goto dispatch;\n", (uint16_t)(addr + 1));
+    }
+    fprintf(out, "\ndispatch:\n    switch (pc) {\n");
+    for (int addr = 0; addr < MEMORY_MAX; ++addr)
+        if (reachable[addr])
+            fprintf(out, "        case 0x%04X: goto L_%04X;\n", addr, addr);
+    fprintf(out, "    }\n");
+    fprintf(out, "    AOT_INTERPRET();\n}\n");
+
+    fclose(out);
+    cout << "Translated " << count << " instructions to " << out_path << endl;
+    return true;
+}
+
+#ifdef LC3_AOT
+// Runtime support for the generated code, which runs on the machine m
+
+// addresses which have translated code, a store to one of them means the program
+// modifies its own code and the translation can't be trusted anymore.
+// Depends only on the built in image, so it is shared by all machines.
+bool aot_code[MEMORY_MAX];
+
+#define AOT_LOAD_REGISTERS() \
+    do { \
+        r0 = m.registers[R_R0]; r1 = m.registers[R_R1]; r2 = m.registers[R_R2]; r3 = m.registers[R_R3]; \
+        r4 = m.registers[R_R4]; r5 = m.registers[R_R5]; r6 = m.registers[R_R6]; r7 = m.registers[R_R7]; \
+        cc = m.cond_result; \
+    } while (0)
+
+#define AOT_SAVE_REGISTERS(next_pc) \
+    do { \
+        m.registers[R_R0] = r0; m.registers[R_R1] = r1; m.registers[R_R2] = r2; m.registers[R_R3] = r3; \
+        m.registers[R_R4] = r4; m.registers[R_R5] = r5; m.registers[R_R6] = r6; m.registers[R_R7] = r7; \
+        m.cond_result = cc; \
+        m.registers[R_PC] = (next_pc); \
+    } while (0)
+
+#define AOT_PROLOGUE() \
+    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cc; \
+    uint16_t pc = m.registers[R_PC]; \
+    AOT_LOAD_REGISTERS(); \
+    goto dispatch
+
+// a store to translated code hands the rest of the run over to the interpreter
+#define AOT_STORE(value, address, next_pc) \
+    do { \
+        uint16_t aot_address = (address); \
+        m.memory_write((value), aot_address); \
+        if (aot_code[aot_address]) { \
+            AOT_SAVE_REGISTERS(next_pc); \
+            m.run_decoded(); \
+            return; \
+        } \
+    } while (0)
+
+// a load which might have hit a device, the device can ask the machine to halt (see request_halt)
+#define AOT_CHECK_HALT(next_pc) \
+    do { \
+        if (m.halt_requested) { \
+            AOT_SAVE_REGISTERS(next_pc); \
+            return; \
+        } \
+    } while (0)
+
+#define AOT_TRAP(instruction, next_pc) \
+    do { \
+        AOT_SAVE_REGISTERS(next_pc); \
+        if (!m.execute_trap((instruction), true)) \
+            return; \
+        AOT_LOAD_REGISTERS(); \
+    } while (0)
+
+// pc has no translated code, interpret until the program gets back to translated code
+#define AOT_INTERPRET() \
+    do { \
+        AOT_SAVE_REGISTERS(pc); \
+        do { \
+            uint16_t instruction = m.memory_read(m.registers[R_PC]++); \
+            if (!m.eval_instruction(instruction, instruction >> 12, true) || m.halt_requested) \
+                return; \
+        } while (!aot_code[m.registers[R_PC]]); \
+        AOT_LOAD_REGISTERS(); \
+        pc = m.registers[R_PC]; \
+        goto dispatch; \
+    } while (0)
+
+#include LC3_AOT
+
+// returns the no. of words loaded
+int aot_load_image(LC3Machine& machine) {
+    size_t words = sizeof(aot_image) / sizeof(aot_image[0]);
+    for (size_t i = 0; i < words; ++i)
+        machine.memory_write(aot_image[i], aot_origin + i);
+    // machines of a batch load the image concurrently
+    static once_flag aot_code_init;
+    call_once(aot_code_init, [] {
+        for (uint16_t addr : aot_translated)
+            aot_code[addr] = true;
+    });
+    return words;
+}
+#endif
+
+#pragma endregion AOT translator
+
+#pragma region Lockstep engine
+
+// Runs up to LOCKSTEP_LANES machines in lockstep, for batches which run one image with many
+// inputs. The state is kept as a structure of arrays: every register and every memory word
+// is a vector with one 16-bit element per lane, so an ADD/AND/NOT, a condition flag update
+// or a load from an address which is the same in all the lanes is one vector op for all
+// the machines.
+//
+// Every step executes the instruction at the lowest PC of the running lanes, for the lanes
+// which are at that PC (and have the same instruction word there). Lanes which took the
+// other side of a branch wait until the rest gets to their PC (min-PC reconvergence), which
+// joins them again after the usual if/else or loop exit. When the lanes don't join again,
+// eg because their inputs send them through different code, fewer and fewer lanes run per
+// step. Once that is less than half of the running lanes, or a lane didn't get to run for a
+// whole window (eg the lanes at a lower PC spin in a loop), the group is split and every lane
+// continues on its own as a normal LC3Machine. The split lanes take turns in slices of
+// LOCKSTEP_SLICE instructions, so a lane which never halts doesn't keep the others from
+// finishing.
+//
+// Loads and stores at addresses which differ between the lanes, the device page and the
+// traps are done lane by lane. Like in the other engines, instructions on the device page are
+// fetched through the device.
+//
+// With an instruction budget every lane counts the steps it ran in, and the group is split
+// once a lane has less than a window of its budget left, so the lanes finish it exactly on
+// their own.
+#if defined(__GNUC__) || defined(__clang__)
+#define LC3_LOCKSTEP_SUPPORTED 1
+#else
+#define LC3_LOCKSTEP_SUPPORTED 0
+#endif
+
+#if LC3_LOCKSTEP_SUPPORTED
+const int LOCKSTEP_LANES = 16;
+// steps between the checks whether the lanes still run together
+const uint64_t LOCKSTEP_WINDOW = 4096;
+// instructions a split lane runs before the next one gets its turn
+const uint64_t LOCKSTEP_SLICE = 1 << 20;
+
+typedef uint16_t LaneVector __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+// result of a comparison, all bits are set in the lanes where it holds
+typedef int16_t LaneMask __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+typedef uint64_t LaneWords __attribute__((vector_size(LOCKSTEP_LANES * sizeof(uint16_t))));
+
+// The engine loop is compiled for AVX2, where a vector of 16 lanes is one register, and for
+// the baseline (two SSE2 registers), the CPU picks one at load time
+#if LC3_SIMD_SWAP
+#define LC3_LANE_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define LC3_LANE_CLONES
+#endif
+
+class LockstepGroup {
+public:
+    // memory[address] holds the word at address of every lane
+    LaneVector memory[MEMORY_MAX];
+    // R_PC and R_COND are not used, see pc and cond_result
+    LaneVector registers[R_COUNT];
+    LaneVector cond_result;
+    LaneVector pc;
+    // bit per lane, set for the lanes which haven't halted
+    uint32_t running = 0;
+    LC3IO* io[LOCKSTEP_LANES] = {};
+
+    // steps run in lockstep and the no. of lanes they ran in total
+    uint64_t steps = 0;
+    uint64_t lane_steps = 0;
+    // lanes which had to continue on their own
+    int split_lanes = 0;
+
+    // instructions every lane may still run, once set_budget was called
+    bool budgeted = false;
+    int64_t budget_left[LOCKSTEP_LANES] = {};
+    // bit per lane, set for the lanes which stopped because they used up their budget
+    uint32_t budget_exhausted = 0;
+
+    LockstepGroup() {
+        memset(memory, 0, sizeof(memory));
+        memset(registers, 0, sizeof(registers));
+        cond_result = LaneVector{};
+        pc = LaneVector{};
+    }
+
+    // lane starts from the given state (as in a MachineState), with its own console
+    void set_lane(int lane, const uint16_t* lane_registers, const uint16_t* lane_memory, LC3IO* lane_io);
+    // every lane runs at most that many instructions, like LC3Machine::set_budget
+    void set_budget(int64_t instructions);
+    // runs until every lane halted
+    void run(bool use_jit);
+
+    // both work on one lane, lane_read like memory_read (incl. the keyboard device) and
+    // lane_trap like execute_trap, it returns false if the lane halted
+    uint16_t lane_read(int lane, uint16_t address);
+    bool lane_trap(int lane, uint16_t trap_code);
+
+private:
+    void split(bool use_jit);
+};
+
+void LockstepGroup::set_lane(int lane, const uint16_t* lane_registers, const uint16_t* lane_memory,
+    LC3IO* lane_io) {
+    for (size_t address = 0; address < MEMORY_MAX; ++address)
+        memory[address][lane] = lane_memory[address];
+    for (int reg = 0; reg < R_COUNT; ++reg)
+        registers[reg][lane] = lane_registers[reg];
+    // a result which has the flag, like LC3Machine::set_cond_flag
+    uint16_t flag = lane_registers[R_COND];
+    cond_result[lane] = flag == FL_NEG ? 0x8000 : (flag == FL_POS ? 1 : 0);
+    pc[lane] = lane_registers[R_PC];
+    io[lane] = lane_io;
+    running |= 1u << lane;
+}
+
+void LockstepGroup::set_budget(int64_t instructions) {
+    budgeted = true;
+    for (int lane = 0; lane < LOCKSTEP_LANES; ++lane)
+        budget_left[lane] = instructions;
+}
+
+uint16_t LockstepGroup::lane_read(int lane, uint16_t address) {
+    // same as keyboard_read
+    if (address == MR_KBSR) {
+        if (io[lane]->input_available()) {
+            int ch = io[lane]->input_read();
+            if (ch == EOF && io[lane]->halt_at_end_of_input()) {
+                running &= ~(1u << lane);
+                memory[MR_KBSR][lane] = 0;
+                return 0;
+            }
+            memory[MR_KBSR][lane] = 1 << 15;
+            memory[MR_KBDR][lane] = ch;
+        }
+        else {
+            memory[MR_KBSR][lane] = 0;
+            io[lane]->output_flush();
+        }
+    }
+    return memory[address][lane];
+}
+
+bool LockstepGroup::lane_trap(int lane, uint16_t trap_code) {
+    // same as LC3Machine::execute_trap, R7 is already set
+    LC3IO* console = io[lane];
+    switch (trap_code) {
+        case TRAP_GETC:
+        case TRAP_IN:
+        {
+            if (trap_code == TRAP_IN)
+                console->output_string("Enter a character");
+            console->output_flush();
+            int ch = console->input_read();
+            if (ch == EOF && console->halt_at_end_of_input())
+                return false;
+            if (trap_code == TRAP_IN) {
+                console->output_char((char)ch);
+                ch = (char)ch;
+            }
+            registers[R_R0][lane] = cond_result[lane] = (uint16_t)ch;
+            break;
+        }
+        case TRAP_OUT:
+            console->output_char((char)registers[R_R0][lane]);
+            break;
+        case TRAP_PUTS:
+            for (uint16_t address = registers[R_R0][lane]; memory[address][lane]; ++address)
+                console->output_char((char)memory[address][lane]);
+            break;
+        case TRAP_PUTSP:
+            for (uint16_t address = registers[R_R0][lane]; memory[address][lane]; ++address) {
+                uint16_t word = memory[address][lane];
+                console->output_char(word & 0xFF);
+                if (word >> 8)
+                    console->output_char(word >> 8);
+            }
+            break;
+        case TRAP_HALT:
+            console->output_string("Program Halted\n");
+            return false;
+        default:
+            break;
+    }
+    return true;
+}
+
+inline bool any_lane(const LaneMask& mask) {
+    LaneWords words = (LaneWords)mask;
+    return (words[0] | words[1] | words[2] | words[3]) != 0;
+}
+
+// target = value in the lanes of mask
+inline void blend_lanes(LaneVector& target, const LaneMask& mask, const LaneVector& value) {
+    target = (value & (LaneVector)mask) | (target & ~(LaneVector)mask);
+}
+
+inline void lanes_mask(uint32_t lanes, LaneMask& mask) {
+    static const LaneVector lane_bit = { 1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+        1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (uint16_t)(1 << 15) };
+    mask = ((LaneVector{} + (uint16_t)lanes) & lane_bit) != 0;
+}
+
+inline uint32_t mask_lanes(const LaneMask& mask) {
+    uint32_t lanes = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; ++lane)
+        lanes |= (uint32_t)(mask[lane] & 1) << lane;
+    return lanes;
+}
+
+// value = the word at address in the lanes, the lanes not in active might get any value
+inline void load_lanes(LockstepGroup& group, uint16_t address, uint32_t active, LaneVector& value) {
+    if ((address >> PAGE_SHIFT) != (MR_KBSR >> PAGE_SHIFT)) {
+        value = group.memory[address];
+        return;
+    }
+    for (uint32_t lanes = active; lanes; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        value[lane] = group.lane_read(lane, address);
+    }
+}
+
+// same for a different address per lane
+inline void gather_lanes(LockstepGroup& group, const LaneVector& addresses, uint32_t active,
+    const LaneMask& active_mask, LaneVector& value) {
+    uint16_t first = addresses[__builtin_ctz(active)];
+    if (!any_lane((addresses != first) & active_mask)) {
+        load_lanes(group, first, active, value);
+        return;
+    }
+    for (uint32_t lanes = active; lanes; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        value[lane] = group.lane_read(lane, addresses[lane]);
+    }
+}
+
+// the device page behaves like RAM for writes (see keyboard_write)
+inline void scatter_lanes(LockstepGroup& group, const LaneVector& addresses, const LaneVector& value,
+    uint32_t active, const LaneMask& active_mask) {
+    uint16_t first = addresses[__builtin_ctz(active)];
+    if (!any_lane((addresses != first) & active_mask)) {
+        blend_lanes(group.memory[first], active_mask, value);
+        return;
+    }
+    for (uint32_t lanes = active; lanes; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        group.memory[addresses[lane]][lane] = value[lane];
+    }
+}
+
+// charges the steps of the window to the budget of the lanes, false if a running lane has
+// less than the next window left
+inline bool lanes_within_budget(LockstepGroup& group, const LaneVector& window_executed) {
+    bool within = true;
+    for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+        group.budget_left[lane] -= window_executed[lane];
+        if ((group.running >> lane & 1) && group.budget_left[lane] < (int64_t)LOCKSTEP_WINDOW)
+            within = false;
+    }
+    return within;
+}
+
+// runs the lanes until they all halted (returns false) or stopped running together (true)
+LC3_LANE_CLONES
+bool run_lockstep(LockstepGroup& group) {
+    uint64_t window_steps = 0, window_lane_steps = 0, window_running = 0;
+    // lanes which ran in this window, and how many steps each one ran (with a budget)
+    uint32_t window_ran = 0;
+    LaneVector window_executed = {};
+    if (group.budgeted && !lanes_within_budget(group, window_executed))
+        return true;
+    while (group.running) {
+        uint32_t running = group.running;
+        LaneMask running_mask;
+        lanes_mask(running, running_mask);
+
+        // the lanes at the lowest PC
+        uint16_t pc = group.pc[__builtin_ctz(running)];
+        uint32_t active = running;
+        LaneMask active_mask = running_mask;
+        if (any_lane((group.pc != pc) & running_mask)) {
+            for (uint32_t lanes = running; lanes; lanes &= lanes - 1)
+                pc = min(pc, group.pc[__builtin_ctz(lanes)]);
+            active_mask = (group.pc == pc) & running_mask;
+            active = mask_lanes(active_mask);
+        }
+        uint16_t instruction;
+        if ((pc >> PAGE_SHIFT) == (MR_KBSR >> PAGE_SHIFT)) {
+            // fetched through the device (see lane_read), which can give every lane a
+            // different word, so one lane at a time
+            int lane = __builtin_ctz(active);
+            active = 1u << lane;
+            lanes_mask(active, active_mask);
+            instruction = group.lane_read(lane, pc);
+            // a KBSR poll past the end of the input halted the lane
+            if (!(group.running & active))
+                continue;
+        }
+        else {
+            // and of those the ones with the same instruction there
+            instruction = group.memory[pc][__builtin_ctz(active)];
+            LaneMask other_code = (group.memory[pc] != instruction) & active_mask;
+            if (any_lane(other_code)) {
+                active_mask &= ~other_code;
+                active = mask_lanes(active_mask);
+            }
+        }
+
+        int active_count = __builtin_popcount(active);
+        ++window_steps;
+        window_lane_steps += active_count;
+        window_running += __builtin_popcount(running);
+        window_ran |= active;
+        if (window_steps == LOCKSTEP_WINDOW) {
+            group.steps += window_steps;
+            group.lane_steps += window_lane_steps;
+            bool within_budget = !group.budgeted || lanes_within_budget(group, window_executed);
+            if (!within_budget || window_lane_steps * 2 < window_running || (group.running & ~window_ran))
+                return true;
+            window_steps = window_lane_steps = window_running = 0;
+            window_ran = 0;
+            window_executed = LaneVector{};
+        }
+        // the mask is all ones (-1) in the active lanes
+        window_executed -= (LaneVector)active_mask;
+
+        uint16_t next_pc = pc + 1;
+        LaneVector& dr = group.registers[(instruction >> 9) & 0x7];
+        const LaneVector& sr1 = group.registers[(instruction >> 6) & 0x7];
+        uint16_t pc_offset9 = next_pc + sign_extend_bits(9, instruction & 0x1FF);
+        uint16_t offset6 = sign_extend_bits(6, instruction & 0x3F);
+        // by default the active lanes go on with the next instruction
+        blend_lanes(group.pc, active_mask, LaneVector{} + next_pc);
+        LaneVector result = {}, address = {};
+
+// writes a result to DR and the condition flag of the active lanes
+#define LANE_RESULT(value) \
+    do { \
+        result = (value); \
+        blend_lanes(dr, active_mask, result); \
+        blend_lanes(group.cond_result, active_mask, result); \
+    } while (0)
+
+        switch (instruction >> 12) {
+            case OP_ADD:
+                if ((instruction >> 5) & 1)
+                    LANE_RESULT(sr1 + sign_extend_bits(5, instruction & 0x1F));
+                else
+                    LANE_RESULT(sr1 + group.registers[instruction & 0x7]);
+                break;
+            case OP_AND:
+                if ((instruction >> 5) & 1)
+                    LANE_RESULT(sr1 & sign_extend_bits(5, instruction & 0x1F));
+                else
+                    LANE_RESULT(sr1 & group.registers[instruction & 0x7]);
+                break;
+            case OP_NOT:
+                LANE_RESULT(~sr1);
+                break;
+            case OP_BR:
+            {
+                uint16_t nzp = (instruction >> 9) & 0x7;
+                LaneMask negative = (LaneMask)group.cond_result < 0;
+                LaneMask zero = group.cond_result == 0;
+                LaneMask taken = LaneMask{};
+                if (nzp & FL_NEG)
+                    taken |= negative;
+                if (nzp & FL_ZRO)
+                    taken |= zero;
+                if (nzp & FL_POS)
+                    taken |= ~negative & ~zero;
+                blend_lanes(group.pc, taken & active_mask, LaneVector{} + pc_offset9);
+                break;
+            }
+            case OP_JMP:
+                blend_lanes(group.pc, active_mask, sr1);
+                break;
+            case OP_JSR:
+            {
+                // read the base register before R7 is overwritten (JSRR R7)
+                LaneVector target = ((instruction >> 11) & 1)
+                    ? LaneVector{} + (uint16_t)(next_pc + sign_extend_bits(11, instruction & 0x7FF)) : sr1;
+                blend_lanes(group.registers[R_R7], active_mask, LaneVector{} + next_pc);
+                blend_lanes(group.pc, active_mask, target);
+                break;
+            }
+            case OP_LD:
+                load_lanes(group, pc_offset9, active, address);
+                LANE_RESULT(address);
+                break;
+            case OP_LDI:
+                load_lanes(group, pc_offset9, active, address);
+                gather_lanes(group, address, active, active_mask, result);
+                LANE_RESULT(result);
+                break;
+            case OP_LDR:
+                gather_lanes(group, sr1 + offset6, active, active_mask, result);
+                LANE_RESULT(result);
+                break;
+            case OP_LEA:
+                LANE_RESULT(LaneVector{} + pc_offset9);
+                break;
+            case OP_ST:
+                scatter_lanes(group, LaneVector{} + pc_offset9, dr, active, active_mask);
+                break;
+            case OP_STI:
+                load_lanes(group, pc_offset9, active, address);
+                scatter_lanes(group, address, dr, active, active_mask);
+                break;
+            case OP_STR:
+                scatter_lanes(group, sr1 + offset6, dr, active, active_mask);
+                break;
+            case OP_TRAP:
+                blend_lanes(group.registers[R_R7], active_mask, LaneVector{} + next_pc);
+                for (uint32_t lanes = active; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    if (!group.lane_trap(lane, instruction & 0xFF))
+                        group.running &= ~(1u << lane);
+                }
+                break;
+            default:
+                // RTI and the reserved opcode do nothing, see eval_instruction
+                break;
+        }
+#undef LANE_RESULT
+    }
+    group.steps += window_steps;
+    group.lane_steps += window_lane_steps;
+    return false;
+}
+
+void LockstepGroup::run(bool use_jit) {
+    if (run_lockstep(*this))
+        split(use_jit);
+}
+
+// runs at most LOCKSTEP_SLICE instructions, false once the program halted or used up the
+// machine's budget (unlike run_for, which doesn't tell whether the last instruction of the
+// slice halted it)
+bool run_slice(LC3Machine& machine) {
+    for (uint64_t executed = 0; executed < LOCKSTEP_SLICE; ++executed) {
+        if (machine.budgeted) {
+            if (machine.budget_left <= 0) {
+                machine.budget_exhausted = true;
+                return false;
+            }
+            --machine.budget_left;
+        }
+        uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+        if (!machine.eval_instruction(instruction, instruction >> 12, true) || machine.halt_requested)
+            return false;
+    }
+    return true;
+}
+
+// every running lane continues on its own. The lanes take turns on one machine, a slice each,
+// the state of the others waits in a MachineState. The last lane runs to its end on the
+// normal engine.
+void LockstepGroup::split(bool use_jit) {
+    int count = 0;
+    int lanes[LOCKSTEP_LANES];
+    MachineState* states[LOCKSTEP_LANES];
+    int64_t budgets[LOCKSTEP_LANES];
+    for (uint32_t left = running; left; left &= left - 1) {
+        int lane = __builtin_ctz(left);
+        MachineState* state = new MachineState;
+        for (size_t address = 0; address < MEMORY_MAX; ++address)
+            state->memory[address] = memory[address][lane];
+        for (int reg = 0; reg < R_COUNT; ++reg)
+            state->registers[reg] = registers[reg][lane];
+        state->registers[R_PC] = pc[lane];
+        state->registers[R_COND] = cond_flag_of(cond_result[lane]);
+        lanes[count] = lane;
+        budgets[count] = budget_left[lane];
+        states[count++] = state;
+    }
+    running = 0;
+    if (!count)
+        return;
+
+    LC3Machine* machine = new LC3Machine(io[lanes[0]]);
+    if (use_jit)
+        machine->jit_init();
+    int turn = 0;
+    while (count) {
+        MachineState* state = states[turn];
+        machine->io = io[lanes[turn]];
+        machine->restore_state(state->registers, state->memory);
+        if (budgeted)
+            machine->set_budget(budgets[turn]);
+        if (count > 1 && run_slice(*machine)) {
+            budgets[turn] = machine->budget_left;
+            machine->sync_cond_register();
+            memcpy(state->registers, machine->registers, sizeof(state->registers));
+            memcpy(state->memory, machine->memory, sizeof(state->memory));
+            turn = (turn + 1) % count;
+            continue;
+        }
+        if (count == 1) {
+            if (machine->jit)
+                machine->run_jit();
+            else
+                machine->run_decoded();
+        }
+        // the lane halted, the last one takes its place
+        if (machine->budget_exhausted)
+            budget_exhausted |= 1u << lanes[turn];
+        ++split_lanes;
+        delete state;
+        --count;
+        lanes[turn] = lanes[count];
+        budgets[turn] = budgets[count];
+        states[turn] = states[count];
+        if (turn == count)
+            turn = 0;
+    }
+    delete machine;
+}
+#endif
+
+#pragma endregion Lockstep engine
+
+#pragma region Batch runner
+
+// Runs many LC-3 jobs in one process: either a list of images, or one image once per
+// input file. Every job gets its own machine, its input from memory and its output
+// captured to <out-dir>/<job>.out, nothing touches the terminal.
+//
+//   ./lc3 --batch [--jit] [--threads N] [--out DIR] [--max-instructions N] <image-file>...
+//   ./lc3 --batch [--jit] [--threads N] [--out DIR] [--max-instructions N] <image-file> --inputs <input-file>...
+//
+// The jobs run on a pool of worker threads (one per hardware thread by default). With
+// --lockstep a worker runs groups of LOCKSTEP_LANES jobs together (see Lockstep engine).
+// Per job stats (status, time, output size) are written to <out-dir>/stats.tsv.
+// With --max-instructions a job which doesn't halt within N instructions is stopped
+// and gets the status "timeout", so a program that hangs can't hold up the batch.
+
+// Console of a batch job: the whole input is known up front, the output goes to a file
+class BatchIO : public ScriptIO {
+public:
+    BatchIO(const string& input, FILE* out) : ScriptIO(input.data(), input.size(), out) {}
+
+    size_t output_bytes = 0;
+
+protected:
+    void write_output(const char* data, size_t size) override {
+        ScriptIO::write_output(data, size);
+        output_bytes += size;
+    }
+};
+
+struct BatchJob {
+    const char* image_path;
+    const char* input_path; // nullptr if the job has no input
+    const MachineState* base = nullptr; // --restore: the snapshot, nullptr if it can't be read
+
+    // results
+    const char* status = "not-run";
+    double seconds = 0;
+    size_t output_bytes = 0;
+};
+
+struct BatchOptions {
+    bool use_jit = false;
+    bool restore = false; // the images are snapshots (see Snapshots)
+    bool lockstep = false;
+    unsigned threads = 0;
+    string out_dir = "batch_out";
+    uint64_t max_instructions = 0; // per job, 0 if there is no limit
+};
+
+// reads the input of the job and opens its output file, nullptr (and the status set) on failure
+FILE* open_batch_job(BatchJob& job, size_t index, const BatchOptions& options, string& input) {
+    if (job.input_path && !read_whole_file(job.input_path, input)) {
+        job.status = "input-failed";
+        return nullptr;
+    }
+    string out_path = options.out_dir + "/" + to_string(index) + ".out";
+    FILE* out = fopen(out_path.c_str(), "wb");
+    if (!out)
+        job.status = "output-failed";
+    return out;
+}
+
+// forked is the machine the worker keeps between --restore jobs (see below)
+void run_batch_job(BatchJob& job, size_t index, const BatchOptions& options, LC3Machine*& forked) {
+    auto start = chrono::steady_clock::now();
+
+    string input;
+    FILE* out = open_batch_job(job, index, options, input);
+    if (!out)
+        return;
+
+    BatchIO io(input, out);
+    LC3Machine* machine;
+    bool loaded;
+#ifdef LC3_AOT
+    machine = new LC3Machine(&io);
+    aot_load_image(*machine);
+    loaded = true;
+#else
+    if (options.restore) {
+        // the worker reuses its machine, going back to the snapshot only copies the pages
+        // the previous job wrote and keeps the rest of the decoded instructions and JIT blocks
+        if (!forked)
+            forked = new LC3Machine(&io);
+        machine = forked;
+        machine->io = &io;
+        loaded = job.base != nullptr;
+        if (loaded && machine->fork_base == job.base)
+            machine->reset();
+        else if (loaded)
+            machine->fork_from(*job.base);
+    }
+    else {
+        machine = new LC3Machine(&io);
+        loaded = machine->load_image(job.image_path) >= 0;
+    }
+#endif
+    if (loaded) {
+        if (!options.restore) {
+            machine->set_cond_flag(FL_ZRO);
+            machine->registers[R_PC] = 0x3000;
+        }
+        if (options.max_instructions)
+            machine->set_budget(options.max_instructions);
+#ifdef LC3_AOT
+        // the translated code doesn't count instructions, a budgeted job runs the
+        // built-in image on the interpreter
+        if (options.max_instructions)
+            machine->run_decoded();
+        else
+            run_aot(*machine);
+#else
+        if (options.use_jit && (machine->jit || machine->jit_init()))
+            machine->run_jit();
+        else
+            machine->run_decoded();
+#endif
+        io.output_flush();
+        // GETC/IN halt once the input file is consumed
+        if (machine->budget_exhausted)
+            job.status = "timeout";
+        else
+            job.status = io.input_ended ? "end-of-input" : "halted";
+    }
+    else {
+        job.status = "load-failed";
+    }
+    if (machine != forked)
+        delete machine;
+    fclose(out);
+
+    job.output_bytes = io.output_bytes;
+    job.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+#if LC3_LOCKSTEP_SUPPORTED && !defined(LC3_AOT)
+// --lockstep: runs jobs first .. first + count - 1 as the lanes of one group
+void run_lockstep_jobs(vector<BatchJob>& jobs, size_t first, size_t count, const BatchOptions& options) {
+    auto start = chrono::steady_clock::now();
+
+    LockstepGroup* group = new LockstepGroup;
+    vector<string> inputs(count);
+    vector<FILE*> outs(count, nullptr);
+    vector<BatchIO*> ios(count, nullptr);
+    for (size_t lane = 0; lane < count; ++lane) {
+        BatchJob& job = jobs[first + lane];
+        outs[lane] = open_batch_job(job, first + lane, options, inputs[lane]);
+        if (!outs[lane])
+            continue;
+        ios[lane] = new BatchIO(inputs[lane], outs[lane]);
+        if (options.restore) {
+            if (job.base)
+                group->set_lane(lane, job.base->registers, job.base->memory, ios[lane]);
+            else
+                job.status = "load-failed";
+        }
+        else {
+            LC3Machine* machine = new LC3Machine(ios[lane]);
+            if (machine->load_image(job.image_path) >= 0) {
+                machine->registers[R_COND] = FL_ZRO;
+                machine->registers[R_PC] = 0x3000;
+                group->set_lane(lane, machine->registers, machine->memory, ios[lane]);
+            }
+            else {
+                job.status = "load-failed";
+            }
+            delete machine;
+        }
+    }
+
+    if (options.max_instructions)
+        group->set_budget(options.max_instructions);
+    group->run(options.use_jit);
+    uint32_t budget_exhausted = group->budget_exhausted;
+    delete group;
+
+    // the lanes ran together, each job gets the time of the whole group
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (size_t lane = 0; lane < count; ++lane) {
+        BatchJob& job = jobs[first + lane];
+        if (!outs[lane])
+            continue;
+        ios[lane]->output_flush();
+        if (budget_exhausted >> lane & 1)
+            job.status = "timeout";
+        else if (strcmp(job.status, "load-failed") != 0)
+            job.status = ios[lane]->input_ended ? "end-of-input" : "halted";
+        job.output_bytes = ios[lane]->output_bytes;
+        job.seconds = seconds;
+        delete ios[lane];
+        fclose(outs[lane]);
+    }
+}
+#endif
+
+// Job queue of one worker. A worker takes jobs from the back of its own queue and once
+// that is empty steals from the front of the other queues, so when a few jobs run much
+// longer than the rest the remaining work moves to the idle workers.
+struct WorkQueue {
+    mutex lock;
+    deque<size_t> jobs;
+};
+
+// next job for worker id, false once every queue is empty (no jobs are added while running)
+bool take_job(vector<WorkQueue>& queues, size_t id, size_t& job) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+        WorkQueue& queue = queues[(id + i) % queues.size()];
+        lock_guard<mutex> lock(queue.lock);
+        if (queue.jobs.empty())
+            continue;
+        if (i == 0) {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+        }
+        else {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+int run_batch(vector<BatchJob>& jobs, const BatchOptions& options) {
+    if (mkdir(options.out_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cout << "Can't create the output directory " << options.out_dir << endl;
+        return 1;
+    }
+
+    size_t thread_count = options.threads ? options.threads : thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+    if (thread_count > jobs.size())
+        thread_count = jobs.size();
+
+    // with --lockstep a queue entry is the first job of a group
+    size_t group_size = 1;
+#if LC3_LOCKSTEP_SUPPORTED && !defined(LC3_AOT)
+    if (options.lockstep)
+        group_size = LOCKSTEP_LANES;
+#endif
+    size_t group_count = (jobs.size() + group_size - 1) / group_size;
+    if (thread_count > group_count)
+        thread_count = group_count;
+
+    // deal the jobs out round robin
+    vector<WorkQueue> queues(thread_count);
+    for (size_t i = 0; i < group_count; ++i)
+        queues[i % thread_count].jobs.push_back(i * group_size);
+
+    auto start = chrono::steady_clock::now();
+    // --restore: every snapshot is read once, the jobs fork from it
+    unordered_map<string, MachineState*> snapshots;
+    if (options.restore) {
+        for (BatchJob& job : jobs) {
+            auto found = snapshots.find(job.image_path);
+            if (found == snapshots.end()) {
+                // nullptr if the file can't be read, the job then fails to load
+                MachineState* state = new MachineState;
+                if (!read_snapshot(job.image_path, *state)) {
+                    delete state;
+                    state = nullptr;
+                }
+                found = snapshots.emplace(job.image_path, state).first;
+            }
+            job.base = found->second;
+        }
+    }
+
+    vector<thread> workers;
+    for (size_t id = 0; id < thread_count; ++id) {
+        workers.emplace_back([&, id] {
+            LC3Machine* forked = nullptr;
+            size_t job;
+            while (take_job(queues, id, job)) {
+#if LC3_LOCKSTEP_SUPPORTED && !defined(LC3_AOT)
+                if (group_size > 1) {
+                    run_lockstep_jobs(jobs, job, min(group_size, jobs.size() - job), options);
+                    continue;
+                }
+#endif
+                run_batch_job(jobs[job], job, options, forked);
+            }
+            delete forked;
+        });
+    }
+    for (thread& worker : workers)
+        worker.join();
+    for (auto& snapshot : snapshots)
+        delete snapshot.second;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    string stats_path = options.out_dir + "/stats.tsv";
+    FILE* stats = fopen(stats_path.c_str(), "w");
+    size_t failed = 0;
+    if (stats)
+        fprintf(stats, "job\timage\tinput\tstatus\tseconds\toutput_bytes\n");
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const BatchJob& job = jobs[i];
+        if (strcmp(job.status, "halted") != 0 && strcmp(job.status, "end-of-input") != 0)
+            ++failed;
+        if (stats)
+            fprintf(stats, "%zu\t%s\t%s\t%s\t%.6f\t%zu\n", i, job.image_path,
+                job.input_path ? job.input_path : "-", job.status, job.seconds, job.output_bytes);
+    }
+    if (stats)
+        fclose(stats);
+
+    cout << "Ran " << jobs.size() << " jobs on " << thread_count << " threads in " << seconds << "s, "
+         << failed << " failed, output in " << options.out_dir << endl;
+    return failed ? 1 : 0;
+}
+
+// parses the arguments following --batch
+int batch_main(int argc, const char* argv[], int first, bool use_jit) {
+    BatchOptions options;
+    options.use_jit = use_jit;
+    vector<const char*> images;
+    vector<const char*> inputs;
+    bool reading_inputs = false;
+    for (int i = first; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0)
+            options.use_jit = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            options.out_dir = argv[++i];
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+            options.max_instructions = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--restore") == 0)
+            options.restore = true;
+        else if (strcmp(argv[i], "--lockstep") == 0)
+            options.lockstep = true;
+        else if (strcmp(argv[i], "--inputs") == 0)
+            reading_inputs = true;
+        else if (reading_inputs)
+            inputs.push_back(argv[i]);
+        else
+            images.push_back(argv[i]);
+    }
+
+    vector<BatchJob> jobs;
+#ifdef LC3_AOT
+    // the image is built in, the jobs only differ by their input
+    if (!images.empty())
+        cout << "Image is built in, ignoring the image files" << endl;
+    images.assign(1, "<built in>");
+#endif
+    if (!inputs.empty() && images.size() == 1) {
+        for (const char* input : inputs)
+            jobs.push_back({ images[0], input });
+    }
+    else if (inputs.empty()) {
+        for (const char* image : images)
+            jobs.push_back({ image, nullptr });
+    }
+    if (jobs.empty()) {
+        cout << "Usage: lc3 --batch [--jit] [--threads N] [--out DIR] [--max-instructions N] [--restore] [--lockstep] <image-file>...\n";
+        cout << "       lc3 --batch [--jit] [--threads N] [--out DIR] [--max-instructions N] [--restore] [--lockstep] <image-file> --inputs <input-file>...\n";
+        return 2;
+    }
+    return run_batch(jobs, options);
+}
+
+#pragma endregion Batch runner
+
+#pragma region Benchmarks
+
+double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Compares the image loaders (fread + scalar swap vs mmap + swap_words), and the swap
+// kernels on their own over the image words:
+//   ./lc3 --bench-load <image-file> [iterations]
+int bench_load(const char* path, int iterations) {
+    LC3Machine* stdio_machine = new LC3Machine(&terminal);
+    LC3Machine* mmap_machine = new LC3Machine(&terminal);
+    int words = stdio_machine->load_image_stdio(path);
+    if (words < 0 || mmap_machine->load_image(path) != words) {
+        cout << "LC3 image load failed\n";
+        return 1;
+    }
+    if (memcmp(stdio_machine->memory, mmap_machine->memory, sizeof(stdio_machine->memory)) != 0) {
+        cout << "Loaders disagree on the memory contents\n";
+        return 1;
+    }
+    cout << "Image: " << path << ", " << words << " words, " << iterations << " iterations" << endl;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        stdio_machine->load_image_stdio(path);
+    double stdio_time = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        mmap_machine->load_image(path);
+    double mmap_time = seconds_since(start);
+
+    printf("%-24s %10.2f us/load\n", "fread + scalar swap", stdio_time * 1e6 / iterations);
+    printf("%-24s %10.2f us/load\n", "mmap/read + swap_words", mmap_time * 1e6 / iterations);
+
+    // kernels alone over a buffer of the image size, the contents don't matter
+    vector<uint16_t> image(words, 0x1234);
+    const char* kernel_names[] = { "scalar", "ssse3", "avx2" };
+    for (int kernel = SWAP_SCALAR; kernel <= swap_kernel; ++kernel) {
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            swap_words(mmap_machine->memory, image.data(), words, (SwapKernel)kernel);
+        double kernel_time = seconds_since(start);
+        printf("swap kernel %-12s %10.2f ns/load, %.2f GB/s\n", kernel_names[kernel],
+            kernel_time * 1e9 / iterations, (double)words * 2 * iterations / kernel_time / 1e9);
+    }
+
+    delete stdio_machine;
+    delete mmap_machine;
+    return 0;
+}
+
+// Benchmark suite, paths are relative to the VirtualMachine directory
+const char* const BENCHMARKS[] = {
+    "assets/bench/loop.obj", // tight arithmetic loop
+    "assets/bench/memcpy.obj", // loads and stores
+    "assets/bench/fib.obj", // recursion, JSR/RET
+    "assets/bench/puts.obj", // console output
+    "assets/bench/sort.obj", // insertion sort
+    "assets/bench/sieve.obj" // sieve of Eratosthenes
+};
+
+// Console of a benchmark run: no input, the output is only counted so that the
+// host terminal doesn't end up in the measurement
+class BenchIO : public LC3IO {
+public:
+    bool input_available() override { return true; }
+    int input_read() override { return EOF; }
+
+    size_t output_bytes = 0;
+
+protected:
+    void write_output(const char*, size_t size) override { output_bytes += size; }
+};
+
+struct CountHooks {
+    uint64_t executed = 0;
+    void before(uint16_t, uint16_t) { ++executed; }
+    void after(uint16_t, uint16_t, uint16_t) {}
+};
+
+// Runs every image runs times with the selected engine and reports the median run:
+//   ./lc3 --bench [--jit] [--runs N] [image-file...]
+// The benchmarks are deterministic, so the no. of instructions is counted once up front
+// with the instrumented loop and the timed runs use the normal dispatch loop.
+int bench_suite(vector<const char*> images, int runs, bool use_jit) {
+    if (images.empty())
+        images.assign(begin(BENCHMARKS), end(BENCHMARKS));
+    if (runs < 1)
+        runs = 1;
+
+    printf("%-26s %12s %5s %11s %9s %9s %11s\n", "benchmark", "instructions", "runs", "median", "MIPS",
+        "ns/instr", "output");
+    for (const char* image : images) {
+        BenchIO io;
+        LC3Machine* machine = new LC3Machine(&io);
+        if (machine->load_image(image) < 0) {
+            printf("%-26s load failed\n", image);
+            delete machine;
+            continue;
+        }
+        machine->set_cond_flag(FL_ZRO);
+        machine->registers[R_PC] = 0x3000;
+        CountHooks counter;
+        run_instrumented(*machine, counter);
+        delete machine;
+
+        vector<double> times;
+        size_t output_bytes = 0;
+        for (int run = 0; run < runs; ++run) {
+            BenchIO run_io;
+            machine = new LC3Machine(&run_io);
+            machine->load_image(image);
+            machine->set_cond_flag(FL_ZRO);
+            machine->registers[R_PC] = 0x3000;
+            bool jit = use_jit && machine->jit_init();
+
+            auto start = chrono::steady_clock::now();
+            if (jit)
+                machine->run_jit();
+            else
+                machine->run_decoded();
+            run_io.output_flush();
+            times.push_back(seconds_since(start));
+
+            output_bytes = run_io.output_bytes;
+            delete machine;
+        }
+        sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+
+        char output[32];
+        if (output_bytes >= 4096)
+            snprintf(output, sizeof(output), "%.1f MB/s", output_bytes / median / 1e6);
+        else
+            snprintf(output, sizeof(output), "%zu B", output_bytes);
+        printf("%-26s %12llu %5d %9.2fms %9.1f %9.2f %11s\n", image, (unsigned long long)counter.executed, runs,
+            median * 1e3, counter.executed / median / 1e6, median * 1e9 / counter.executed, output);
+    }
+    return 0;
+}
+
+#pragma endregion Benchmarks
+
+#pragma region Fuzzer
+
+// Coverage guided fuzzing of a program's keyboard input, in process:
+//   ./lc3 --fuzz [--runs N] [--seconds S] [--corpus DIR] [--seed N] [--max-len N]
+//                [--max-instructions N] [--restore] <image-file | snapshot-file>
+//
+// Every exec resets a machine forked from the image (or snapshot) to its start, feeds it
+// a mutated input through ScriptIO (GETC, IN, KBSR/KBDR, the program halts at the end of
+// the input) and runs it on run_decoded with a CoverageMonitor, which counts the edges
+// taken by BR/JMP/JSR into a coverage map. Inputs which reach a new edge, or an edge a new no. of
+// times, join the corpus and are saved to DIR. Inputs which run into an illegal opcode
+// (RTI/reserved) or past the instruction limit are saved too, one per illegal opcode address
+// and the hangs which take edges (or edge counts) no earlier hang took.
+
+const size_t COVERAGE_MAP_SIZE = 1 << 16;
+
+// Console of a fuzzing exec: input from the current test case, the output is dropped
+class FuzzIO : public ScriptIO {
+public:
+    FuzzIO(const string& input) : ScriptIO(input.data(), input.size(), nullptr) {}
+
+protected:
+    void write_output(const char*, size_t) override {}
+};
+
+// Coverage of an exec, collected by run_decoded itself (see NoMonitor), so the execs run on
+// the decoded instruction cache and the superinstructions instead of eval_instruction
+struct CoverageMonitor : NoMonitor {
+    static const bool ACTIVE = true;
+    uint8_t* map; // hit count per edge, wraps around like AFL's
+    uint64_t max_instructions;
+    uint64_t executed = 0;
+    bool illegal = false;
+    uint16_t illegal_pc = 0;
+
+    CoverageMonitor(uint8_t* map, uint64_t max_instructions) : map(map), max_instructions(max_instructions) {}
+
+    bool dispatch(uint16_t) {
+        // a hang, stop at the instruction past the limit
+        if (executed == max_instructions)
+            return false;
+        ++executed;
+        return true;
+    }
+
+    bool run_fused(int extra) {
+        if (executed + extra > max_instructions)
+            return false;
+        executed += extra;
+        return true;
+    }
+
+    void edge(uint16_t from, uint16_t to) {
+        ++map[((from * 2654435761u) >> 16 ^ to) & (COVERAGE_MAP_SIZE - 1)];
+    }
+
+    void evaluated(uint16_t pc, uint16_t instruction, uint16_t next_pc) {
+        uint16_t opcode = instruction >> 12;
+        if ((opcode == OP_RES || opcode == OP_RTI) && !illegal) {
+            illegal = true;
+            illegal_pc = pc;
+        }
+        // a not taken branch is an edge too (to pc + 1)
+        if (is_control_transfer(instruction))
+            edge(pc, next_pc);
+    }
+};
+
+// AFL style hit count classes, an edge taken a new no. of times (in these classes) counts as new coverage
+inline uint8_t hit_count_class(uint8_t count) {
+    if (count <= 2)
+        return count;
+    if (count == 3)
+        return 4;
+    if (count < 8)
+        return 8;
+    if (count < 16)
+        return 16;
+    if (count < 32)
+        return 32;
+    return count < 128 ? 64 : 128;
+}
+
+struct FuzzOptions {
+    uint64_t runs = 0; // 0: no limit
+    double seconds = 0; // 0: no limit
+    string corpus_dir = "fuzz_corpus";
+    uint64_t seed = 1;
+    size_t max_len = 256;
+    uint64_t max_instructions = 1000000;
+    bool restore = false; // the image is a snapshot
+};
+
+class Fuzzer {
+public:
+    Fuzzer(LC3Machine& machine, const FuzzOptions& options)
+        : machine(machine), options(options), rng(options.seed ? options.seed : 1) {}
+
+    // runs input on the machine, adds it to the corpus (and saves it) if it found something new
+    void exec(const string& input) {
+        FuzzIO io(input);
+        machine.io = &io;
+        machine.reset();
+        memset(map, 0, sizeof(map));
+        CoverageMonitor coverage(map, options.max_instructions);
+        machine.run_decoded(coverage);
+        ++execs;
+
+        if (coverage.illegal) {
+            ++illegal;
+            if (!illegal_seen[coverage.illegal_pc]) {
+                illegal_seen[coverage.illegal_pc] = true;
+                save("illegal", input);
+            }
+        }
+        else if (coverage.executed >= options.max_instructions) {
+            ++hangs;
+            if (new_coverage(hang_seen, hang_edges))
+                save("hang", input);
+        }
+        if (new_coverage(seen, edges)) {
+            corpus.push_back(input);
+            save("input", input);
+        }
+    }
+
+    int run() {
+        // the corpus dir might have inputs of an earlier session, they are the seeds
+        vector<string> seeds = read_corpus();
+        if (seeds.empty()) {
+            exec("");
+            if (corpus.empty())
+                corpus.push_back("");
+        }
+        else {
+            // the seeds are already saved and all of them stay in the corpus
+            for (const string& seed : seeds) {
+                size_t size = corpus.size();
+                replaying = true;
+                exec(seed);
+                replaying = false;
+                if (corpus.size() == size)
+                    corpus.push_back(seed);
+            }
+        }
+
+        auto start = chrono::steady_clock::now();
+        double next_status = 1;
+        while ((!options.runs || execs < options.runs) && !interrupted) {
+            exec(mutate(corpus[next_random() % corpus.size()]));
+            if ((execs & 0xFF) == 0) {
+                double elapsed = seconds_since(start);
+                if (options.seconds && elapsed >= options.seconds)
+                    break;
+                if (elapsed >= next_status) {
+                    status(elapsed);
+                    next_status = elapsed + 1;
+                }
+            }
+        }
+        status(seconds_since(start));
+        return 0;
+    }
+
+    // set by SIGINT, the fuzzer stops after the current exec
+    static volatile sig_atomic_t interrupted;
+
+private:
+    LC3Machine& machine;
+    const FuzzOptions& options;
+    uint64_t rng;
+
+    uint8_t map[COVERAGE_MAP_SIZE];
+    uint8_t seen[COVERAGE_MAP_SIZE] = {}; // hit count classes seen per edge
+    uint8_t hang_seen[COVERAGE_MAP_SIZE] = {}; // same for the hangs only
+    bool illegal_seen[MEMORY_MAX] = {}; // addresses of the illegal opcodes found
+    vector<string> corpus;
+    uint64_t execs = 0;
+    size_t edges = 0;
+    size_t hang_edges = 0;
+    size_t hangs = 0;
+    size_t illegal = 0;
+    size_t last_file_id = 0; // files are numbered across kinds and sessions
+    bool replaying = false;
+
+    uint64_t next_random() {
+        // xorshift64
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    }
+
+    // merges the coverage map of the last exec into seen_classes, true if it had anything new
+    bool new_coverage(uint8_t* seen_classes, size_t& edge_count) {
+        bool found = false;
+        const uint64_t* words = (const uint64_t*)map;
+        for (size_t word = 0; word < COVERAGE_MAP_SIZE / 8; ++word) {
+            if (!words[word])
+                continue;
+            for (size_t i = word * 8; i < word * 8 + 8; ++i) {
+                uint8_t hit_class = hit_count_class(map[i]);
+                if (hit_class & ~seen_classes[i]) {
+                    if (!seen_classes[i])
+                        ++edge_count;
+                    seen_classes[i] |= hit_class;
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // 1 to 8 stacked random edits, biased to printable chars since most programs read text
+    string mutate(string input) {
+        int edits = 1 + next_random() % 8;
+        for (int i = 0; i < edits; ++i) {
+            size_t pos = input.empty() ? 0 : next_random() % input.size();
+            switch (next_random() % 7) {
+                case 0: // flip a bit
+                    if (!input.empty())
+                        input[pos] ^= 1 << (next_random() % 8);
+                    break;
+                case 1: // random byte
+                    if (!input.empty())
+                        input[pos] = (char)next_random();
+                    break;
+                case 2: // printable char
+                    if (!input.empty())
+                        input[pos] = ' ' + next_random() % 95;
+                    break;
+                case 3: // insert a printable char
+                    input.insert(input.begin() + pos, (char)(' ' + next_random() % 95));
+                    break;
+                case 4: // delete a char
+                    if (!input.empty())
+                        input.erase(pos, 1);
+                    break;
+                case 5: // repeat a chunk
+                    if (!input.empty())
+                        input.insert(pos, input.substr(next_random() % input.size(), 1 + next_random() % 8));
+                    break;
+                case 6: // splice with another corpus entry
+                {
+                    const string& other = corpus[next_random() % corpus.size()];
+                    input = input.substr(0, pos) + other.substr(other.empty() ? 0 : next_random() % other.size());
+                    break;
+                }
+            }
+        }
+        if (input.size() > options.max_len)
+            input.resize(options.max_len);
+        return input;
+    }
+
+    void save(const char* kind, const string& input) {
+        if (replaying)
+            return;
+        char name[32];
+        snprintf(name, sizeof(name), "/%s_%06zu", kind, ++last_file_id);
+        FILE* file = fopen((options.corpus_dir + name).c_str(), "wb");
+        if (!file)
+            return;
+        fwrite(input.data(), 1, input.size(), file);
+        fclose(file);
+    }
+
+    vector<string> read_corpus() {
+        vector<string> seeds;
+        DIR* dir = opendir(options.corpus_dir.c_str());
+        if (!dir)
+            return seeds;
+        vector<string> names;
+        while (dirent* entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "input_", 6) == 0)
+                names.push_back(entry->d_name);
+            // new files are numbered after the ones already there
+            const char* id = strrchr(entry->d_name, '_');
+            if (id)
+                last_file_id = max(last_file_id, (size_t)strtoull(id + 1, nullptr, 10));
+        }
+        closedir(dir);
+        // replayed in the order they were found
+        sort(names.begin(), names.end());
+        for (const string& name : names) {
+            string input;
+            if (read_whole_file((options.corpus_dir + "/" + name).c_str(), input))
+                seeds.push_back(input);
+        }
+        return seeds;
+    }
+
+    void status(double elapsed) {
+        printf("execs %llu  %.0f/s  corpus %zu  edges %zu  hangs %zu  illegal %zu\n",
+            (unsigned long long)execs, elapsed > 0 ? execs / elapsed : 0.0, corpus.size(), edges, hangs, illegal);
+        fflush(stdout);
+    }
+};
+
+volatile sig_atomic_t Fuzzer::interrupted = 0;
+
+void fuzz_interrupt_handler(int) {
+    Fuzzer::interrupted = 1;
+}
+
+int fuzz_main(int argc, const char* argv[], int first) {
+    FuzzOptions options;
+    const char* image_path = nullptr;
+    for (int i = first; i < argc; ++i) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+            options.runs = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            options.seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc)
+            options.corpus_dir = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--max-len") == 0 && i + 1 < argc)
+            options.max_len = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc)
+            options.max_instructions = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--restore") == 0)
+            options.restore = true;
+        else
+            image_path = argv[i];
+    }
+    if (!image_path) {
+        cout << "Usage: lc3 --fuzz [--runs N] [--seconds S] [--corpus DIR] [--seed N] [--max-len N]\n";
+        cout << "                  [--max-instructions N] [--restore] <image-file | snapshot-file>\n";
+        return 2;
+    }
+    if (mkdir(options.corpus_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cout << "Can't create the corpus directory " << options.corpus_dir << endl;
+        return 1;
+    }
+
+    // the state every exec starts from
+    FuzzIO no_input("");
+    LC3Machine* machine = new LC3Machine(&no_input);
+    MachineState* base = new MachineState;
+    if (options.restore) {
+        if (!read_snapshot(image_path, *base)) {
+            cout << "LC3 snapshot restore failed\n";
+            return 1;
+        }
+    }
+    else {
+        if (machine->load_image(image_path) < 0) {
+            cout << "LC3 image load failed\n";
+            return 1;
+        }
+        machine->set_cond_flag(FL_ZRO);
+        machine->registers[R_PC] = 0x3000;
+        machine->sync_cond_register();
+        memcpy(base->registers, machine->registers, sizeof(base->registers));
+        memcpy(base->memory, machine->memory, sizeof(base->memory));
+    }
+    machine->fork_from(*base);
+
+    signal(SIGINT, fuzz_interrupt_handler);
+    Fuzzer* fuzzer = new Fuzzer(*machine, options);
+    int result = fuzzer->run();
+    delete fuzzer;
+    delete machine;
+    delete base;
+    return result;
+}
+
+#pragma endregion Fuzzer
+
+#pragma region Reverse debugger
+
+// Debugger which runs the program backwards as well as forwards:
+//
+//   ./lc3 --debug [--checkpoint-every N] [--input-file <file> | --input-string <keys>] <image-file>
+//
+// The program's keyboard is the script (the same part of the run always reads the same keys),
+// the terminal belongs to the debugger, see "help" for the commands. Going back uses
+//  - an undo log, one entry per instruction since the last checkpoint: its PC, the condition
+//    result and the register or memory word it overwrote. Stepping back pops the entry.
+//  - a checkpoint every N instructions: the registers, the console position and the memory
+//    pages written before the next checkpoint, as they were at this one. The written pages
+//    are known from the dirty page tracking (see fork_from) and their old contents come from a
+//    shadow copy of the memory at the last checkpoint, so a checkpoint only copies the pages
+//    its interval wrote. Going back to checkpoint k copies the pages of the later checkpoints
+//    back, newest first, any point after it is reached by running forward again.
+// Instructions whose effects the undo log doesn't hold (traps, device accesses) are undone the
+// second way. The searches backwards (reverse-continue, last-write) look through the undo log
+// first, then run the earlier intervals again on a scratch machine, newest first (last-write
+// skips the intervals which didn't write the page).
+
+const uint8_t UNDO_MEMORY = 1 << 0; // address held word before the instruction
+const uint8_t UNDO_REPLAY = 1 << 1; // can only be undone by running from a checkpoint
+
+struct UndoEntry {
+    uint16_t pc;
+    uint16_t cond_result;
+    uint16_t reg_value; // old value of reg
+    uint16_t address;
+    uint16_t word;
+    uint8_t reg;
+    uint8_t flags;
+};
+
+// What the instruction at pc is about to overwrite, for the memory as it is now. Runs before
+// every recorded instruction, so it is computed without branching on the opcode (that would
+// be a second hard to predict jump next to the one in eval_instruction): every entry holds a
+// register (DR, R7 for JSR) and for the stores the word at the target. For the instructions
+// which don't write DR it is restored to the value it has anyway.
+inline UndoEntry make_undo_entry(const LC3Machine& machine, uint16_t pc, uint16_t instruction) {
+    const uint16_t PC_RELATIVE = 1 << OP_LD | 1 << OP_ST | 1 << OP_LDI | 1 << OP_STI;
+    const uint16_t BASE_RELATIVE = 1 << OP_LDR | 1 << OP_STR;
+    const uint16_t INDIRECT = 1 << OP_LDI | 1 << OP_STI;
+    const uint16_t STORES = 1 << OP_ST | 1 << OP_STR | 1 << OP_STI;
+    uint16_t opcode = instruction >> 12;
+    uint16_t pc_offset = pc + 1 + sign_extend_bits(9, instruction & 0x1FF);
+    uint16_t base_offset = machine.registers[(instruction >> 6) & 0x7] + sign_extend_bits(6, instruction & 0x3F);
+
+    uint16_t address = (BASE_RELATIVE >> opcode & 1) ? base_offset : pc_offset;
+    uint16_t pointer = machine.memory[pc_offset];
+    bool indirect = INDIRECT >> opcode & 1;
+    // accesses through a device (and the traps, which use the console) can't be undone by the entry
+    bool device = machine.is_device_page(pc) | (opcode == OP_TRAP)
+        | (((PC_RELATIVE | BASE_RELATIVE) >> opcode & 1) & machine.is_device_page(address))
+        | (indirect & machine.is_device_page(pointer));
+    address = indirect ? pointer : address;
+
+    uint8_t reg = opcode == OP_JSR ? R_R7 : (instruction >> 9) & 0x7;
+    uint8_t flags = ((STORES >> opcode & 1) ? UNDO_MEMORY : 0) | (device ? UNDO_REPLAY : 0);
+    return { pc, machine.cond_result, machine.registers[reg], address, machine.memory[address], reg, flags };
+}
+
+struct Checkpoint {
+    uint64_t count; // instructions executed before it
+    uint16_t registers[R_COUNT];
+    uint16_t cond_result;
+    size_t input_position;
+    bool input_ended;
+    uint64_t output_count;
+    // the pages written between this checkpoint and the next one, as they were here
+    uint64_t page_mask = 0;
+    vector<uint16_t> pages;
+};
+
+// Console of the debugged program: the keyboard is the script, the output goes to stdout
+// unless it was shown already, ie when the program runs a part again after going back
+class DebugIO : public ScriptIO {
+public:
+    DebugIO(const string& script, bool quiet) : ScriptIO(script.data(), script.size(), stdout), quiet(quiet) {}
+
+    uint64_t output_count = 0; // bytes the program printed up to this point of the run
+    uint64_t output_shown = 0;
+
+protected:
+    void write_output(const char* data, size_t size) override {
+        if (!quiet && output_count + size > output_shown) {
+            size_t skip = output_shown > output_count ? output_shown - output_count : 0;
+            ScriptIO::write_output(data + skip, size - skip);
+            fflush(stdout);
+            output_shown = output_count + size;
+        }
+        output_count += size;
+    }
+
+private:
+    bool quiet;
+};
+
+class ReverseDebugger {
+public:
+    ReverseDebugger(LC3Machine& machine, DebugIO& io, const string& script, uint64_t interval);
+    ~ReverseDebugger();
+
+    // reads commands from stdin until quit or EOF
+    void command_loop();
+
+private:
+    // runs up to steps instructions, stops early at the end of the program and (if
+    // stop_at_breakpoint) after the instructions which lead to a breakpoint. Without record
+    // the undo log is dropped, the run only takes the checkpoints and runs on run_decoded.
+    void run_forward(uint64_t steps, bool stop_at_breakpoint, bool record);
+    uint64_t execute(uint64_t steps, bool stop_at_breakpoint, bool& at_breakpoint);
+    uint64_t execute_decoded(uint64_t steps, bool stop_at_breakpoint, bool& at_breakpoint);
+    void step_back(uint64_t steps);
+    // moves to the point where target instructions were executed (or the end of the program)
+    void go_to(uint64_t target);
+    void pop_undo();
+    void take_checkpoint();
+    Checkpoint capture() const;
+    // goes back to checkpoints[index], the later ones are dropped
+    void rewind(size_t index);
+    void copy_page(size_t page, const uint16_t* data);
+
+    void reverse_continue();
+    void last_write(uint16_t address);
+    template <class Finder>
+    bool search_intervals(Finder& finder);
+
+    void show_position();
+    void show_registers();
+
+    LC3Machine& machine;
+    DebugIO& io;
+    uint64_t interval;
+    uint64_t count = 0;
+    bool halted = false;
+
+    vector<Checkpoint> checkpoints;
+    vector<UndoEntry> undo; // the last undo.size() instructions, all after checkpoints.back()
+    vector<uint16_t> shadow; // the memory at checkpoints.back()
+    vector<uint8_t> breakpoints = vector<uint8_t>(MEMORY_MAX, 0);
+
+    // runs the earlier intervals for the searches
+    DebugIO scratch_io;
+    LC3Machine* scratch = nullptr;
+};
+
+ReverseDebugger::ReverseDebugger(LC3Machine& machine, DebugIO& io, const string& script, uint64_t interval)
+    : machine(machine), io(io), interval(interval), scratch_io(script, true) {
+    shadow.assign(machine.memory, machine.memory + MEMORY_MAX);
+    machine.dirty_pages = 0;
+    checkpoints.push_back(capture());
+    undo.reserve(min<uint64_t>(interval, 1 << 24));
+}
+
+ReverseDebugger::~ReverseDebugger() {
+    delete scratch;
+}
+
+Checkpoint ReverseDebugger::capture() const {
+    Checkpoint checkpoint;
+    checkpoint.count = count;
+    memcpy(checkpoint.registers, machine.registers, sizeof(checkpoint.registers));
+    checkpoint.cond_result = machine.cond_result;
+    checkpoint.input_position = io.input_position();
+    checkpoint.input_ended = io.input_ended;
+    checkpoint.output_count = io.output_count;
+    return checkpoint;
+}
+
+uint64_t ReverseDebugger::execute(uint64_t steps, bool stop_at_breakpoint, bool& at_breakpoint) {
+    size_t first = undo.size();
+    undo.resize(first + steps);
+    UndoEntry* entry = undo.data() + first;
+    uint64_t executed = 0;
+    while (executed < steps) {
+        uint16_t pc = machine.registers[R_PC];
+        *entry++ = make_undo_entry(machine, pc, machine.memory[pc]);
+        uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+        bool run = machine.eval_instruction(instruction, instruction >> 12, true);
+        ++executed;
+        if (!run || machine.halt_requested) {
+            halted = true;
+            break;
+        }
+        if (stop_at_breakpoint && breakpoints[machine.registers[R_PC]]) {
+            at_breakpoint = true;
+            break;
+        }
+    }
+    undo.resize(first + executed);
+    return executed;
+}
+
+// Lets run_decoded run the instructions of continue: counts them and stops the run after
+// limit of them or (if stop_at_breakpoint) at a breakpoint, except the one the run starts
+// at. A superinstruction only runs whole if no breakpoint is on one of its extra words.
+struct DebugMonitor : NoMonitor {
+    static const bool ACTIVE = true;
+    uint64_t limit;
+    uint64_t executed = 0;
+    bool stopped = false;
+
+    DebugMonitor(const vector<uint8_t>& breakpoints, uint64_t limit, bool stop_at_breakpoint)
+        : limit(limit), breakpoints(stop_at_breakpoint ? breakpoints.data() : no_breakpoints) {}
+
+    bool dispatch(uint16_t pc) {
+        if (executed == limit || stops[pc]) {
+            stopped = true;
+            return false;
+        }
+        ++executed;
+        // the 1st instruction runs even if it is at a breakpoint
+        stops = breakpoints;
+        last_pc = pc;
+        return true;
+    }
+
+    bool run_fused(int extra) {
+        if (executed + extra > limit)
+            return false;
+        for (int i = 1; i <= extra; ++i) {
+            if (breakpoints[(uint16_t)(last_pc + i)])
+                return false;
+        }
+        executed += extra;
+        return true;
+    }
+
+private:
+    static const uint8_t no_breakpoints[MEMORY_MAX];
+    const uint8_t* breakpoints;
+    const uint8_t* stops = no_breakpoints;
+    uint16_t last_pc = 0; // of the last instruction dispatched
+};
+
+const uint8_t DebugMonitor::no_breakpoints[MEMORY_MAX] = {};
+
+// same as execute without the undo log, on the decoded loop
+uint64_t ReverseDebugger::execute_decoded(uint64_t steps, bool stop_at_breakpoint, bool& at_breakpoint) {
+    DebugMonitor monitor(breakpoints, steps, stop_at_breakpoint);
+    machine.run_decoded(monitor);
+    if (!monitor.stopped)
+        halted = true;
+    else if (stop_at_breakpoint && breakpoints[machine.registers[R_PC]])
+        at_breakpoint = true;
+    return monitor.executed;
+}
+
+void ReverseDebugger::run_forward(uint64_t steps, bool stop_at_breakpoint, bool record) {
+    bool at_breakpoint = false;
+    while (steps && !halted && !at_breakpoint) {
+        // up to the next checkpoint
+        uint64_t chunk = min(steps, checkpoints.back().count + interval - count);
+        uint64_t executed;
+        if (record) {
+            executed = execute(chunk, stop_at_breakpoint, at_breakpoint);
+        }
+        else {
+            undo.clear();
+            executed = execute_decoded(chunk, stop_at_breakpoint, at_breakpoint);
+        }
+        count += executed;
+        steps -= executed;
+        if (!halted && count - checkpoints.back().count >= interval)
+            take_checkpoint();
+    }
+}
+
+void ReverseDebugger::pop_undo() {
+    const UndoEntry& entry = undo.back();
+    machine.registers[R_PC] = entry.pc;
+    machine.cond_result = entry.cond_result;
+    machine.registers[entry.reg] = entry.reg_value;
+    if (entry.flags & UNDO_MEMORY)
+        machine.ram_write(entry.word, entry.address);
+    undo.pop_back();
+    --count;
+    halted = false;
+}
+
+void ReverseDebugger::step_back(uint64_t steps) {
+    uint64_t target = steps < count ? count - steps : 0;
+    go_to(target);
+}
+
+void ReverseDebugger::go_to(uint64_t target) {
+    if (target < count) {
+        // the undo log does it if it reaches back that far without a replay entry
+        uint64_t base = count - undo.size();
+        bool undoable = target >= base && none_of(undo.begin() + (target - base), undo.end(),
+            [](const UndoEntry& entry) { return (entry.flags & UNDO_REPLAY) != 0; });
+        if (undoable) {
+            while (count > target)
+                pop_undo();
+            return;
+        }
+        // else from the last checkpoint at or before target
+        size_t index = checkpoints.size() - 1;
+        while (checkpoints[index].count > target)
+            --index;
+        rewind(index);
+    }
+    run_forward(target - count, false, true);
+}
+
+void ReverseDebugger::copy_page(size_t page, const uint16_t* data) {
+    size_t first = page << DIRTY_PAGE_SHIFT;
+    memcpy(machine.memory + first, data, DIRTY_PAGE_SIZE * sizeof(uint16_t));
+    memcpy(shadow.data() + first, data, DIRTY_PAGE_SIZE * sizeof(uint16_t));
+    machine.drop_decoded(first, DIRTY_PAGE_SIZE);
+}
+
+void ReverseDebugger::take_checkpoint() {
+    // the output so far has to be counted by the checkpoint
+    io.output_flush();
+    Checkpoint& last = checkpoints.back();
+    last.page_mask = machine.dirty_pages;
+    for (size_t page = 0; page < DIRTY_PAGE_COUNT; ++page) {
+        if (!(last.page_mask >> page & 1))
+            continue;
+        size_t first = page << DIRTY_PAGE_SHIFT;
+        last.pages.insert(last.pages.end(), shadow.begin() + first, shadow.begin() + first + DIRTY_PAGE_SIZE);
+        memcpy(shadow.data() + first, machine.memory + first, DIRTY_PAGE_SIZE * sizeof(uint16_t));
+    }
+    machine.dirty_pages = 0;
+    checkpoints.push_back(capture());
+    undo.clear();
+}
+
+void ReverseDebugger::rewind(size_t index) {
+    io.output_flush();
+    // back to the last checkpoint, then through the pages of the ones before it
+    for (size_t page = 0; page < DIRTY_PAGE_COUNT; ++page) {
+        if (machine.dirty_pages >> page & 1)
+            copy_page(page, shadow.data() + (page << DIRTY_PAGE_SHIFT));
+    }
+    for (size_t i = checkpoints.size() - 1; i-- > index;) {
+        const uint16_t* data = checkpoints[i].pages.data();
+        for (size_t page = 0; page < DIRTY_PAGE_COUNT; ++page) {
+            if (checkpoints[i].page_mask >> page & 1) {
+                copy_page(page, data);
+                data += DIRTY_PAGE_SIZE;
+            }
+        }
+    }
+    checkpoints.resize(index + 1);
+    Checkpoint& checkpoint = checkpoints.back();
+    checkpoint.page_mask = 0;
+    checkpoint.pages.clear();
+    machine.dirty_pages = 0;
+
+    memcpy(machine.registers, checkpoint.registers, sizeof(machine.registers));
+    machine.cond_result = checkpoint.cond_result;
+    machine.halt_requested = false;
+    io.seek_input(checkpoint.input_position, checkpoint.input_ended);
+    io.output_count = checkpoint.output_count;
+    count = checkpoint.count;
+    halted = false;
+    undo.clear();
+}
+
+// Runs what the undo log doesn't cover again on the scratch machine, an interval between two
+// checkpoints at a time, newest first, until one in which the finder found something.
+// Finder has
+//   bool skip(uint64_t page_mask); // an interval which wrote these pages can't have a match
+//   void before(const LC3Machine& machine, uint64_t time); // the next instruction runs at time
+//   bool found;
+template <class Finder>
+bool ReverseDebugger::search_intervals(Finder& finder) {
+    if (!scratch)
+        scratch = new LC3Machine(&scratch_io);
+    // the memory at checkpoints[i], starting from the last one
+    vector<uint16_t> memory(shadow);
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        const Checkpoint& checkpoint = checkpoints[i];
+        uint64_t end, page_mask;
+        if (i + 1 == checkpoints.size()) {
+            // the current interval, up to where the undo log starts
+            end = count - undo.size();
+            page_mask = machine.dirty_pages;
+        }
+        else {
+            end = checkpoints[i + 1].count;
+            page_mask = checkpoint.page_mask;
+            const uint16_t* data = checkpoint.pages.data();
+            for (size_t page = 0; page < DIRTY_PAGE_COUNT; ++page) {
+                if (page_mask >> page & 1) {
+                    memcpy(memory.data() + (page << DIRTY_PAGE_SHIFT), data, DIRTY_PAGE_SIZE * sizeof(uint16_t));
+                    data += DIRTY_PAGE_SIZE;
+                }
+            }
+        }
+        if (checkpoint.count == end || finder.skip(page_mask))
+            continue;
+
+        scratch->restore_state(checkpoint.registers, memory.data());
+        scratch->cond_result = checkpoint.cond_result;
+        scratch_io.seek_input(checkpoint.input_position, checkpoint.input_ended);
+        for (uint64_t time = checkpoint.count; time < end; ++time) {
+            finder.before(*scratch, time);
+            uint16_t instruction = scratch->memory_read(scratch->registers[R_PC]++);
+            scratch->eval_instruction(instruction, instruction >> 12, true);
+        }
+        if (finder.found)
+            return true;
+    }
+    return false;
+}
+
+struct BreakpointFinder {
+    const vector<uint8_t>& breakpoints;
+    bool found = false;
+    uint64_t time = 0;
+
+    bool skip(uint64_t) { return false; }
+    void before(const LC3Machine& machine, uint64_t at) {
+        if (breakpoints[machine.registers[R_PC]]) {
+            found = true;
+            time = at;
+        }
+    }
+};
+
+struct WriteFinder {
+    uint16_t address;
+    bool found = false;
+    uint64_t time = 0;
+    uint16_t pc = 0;
+
+    bool skip(uint64_t page_mask) { return !(page_mask >> (address >> DIRTY_PAGE_SHIFT) & 1); }
+    void before(const LC3Machine& machine, uint64_t at) {
+        uint16_t at_pc = machine.registers[R_PC];
+        UndoEntry entry = make_undo_entry(machine, at_pc, machine.memory[at_pc]);
+        if ((entry.flags & UNDO_MEMORY) && entry.address == address) {
+            found = true;
+            time = at;
+            pc = at_pc;
+        }
+    }
+};
+
+void ReverseDebugger::reverse_continue() {
+    uint64_t base = count - undo.size();
+    for (size_t i = undo.size(); i-- > 0;) {
+        if (breakpoints[undo[i].pc]) {
+            go_to(base + i);
+            return;
+        }
+    }
+    BreakpointFinder finder = { breakpoints };
+    if (search_intervals(finder)) {
+        go_to(finder.time);
+        return;
+    }
+    go_to(0);
+    printf("Reached the start of the program\n");
+}
+
+void ReverseDebugger::last_write(uint16_t address) {
+    uint64_t base = count - undo.size();
+    WriteFinder finder = { address };
+    for (size_t i = undo.size(); i-- > 0 && !finder.found;) {
+        if ((undo[i].flags & UNDO_MEMORY) && undo[i].address == address) {
+            finder.found = true;
+            finder.time = base + i;
+            finder.pc = undo[i].pc;
+        }
+    }
+    if (finder.found || search_intervals(finder)) {
+        // the instruction might have been overwritten since, show it from the time it ran
+        printf("x%04X was last written at #%llu by the instruction at x%04X\n", address,
+            (unsigned long long)finder.time, finder.pc);
+    }
+    else {
+        printf("x%04X wasn't written since the start, it holds x%04X\n", address, machine.memory[address]);
+    }
+}
+
+void ReverseDebugger::show_position() {
+    uint16_t pc = machine.registers[R_PC];
+    if (halted)
+        printf("Program halted at #%llu\n", (unsigned long long)count);
+    else
+        printf("#%llu  x%04X: %s\n", (unsigned long long)count, pc, disassemble(pc, machine.memory[pc]).c_str());
+}
+
+void ReverseDebugger::show_registers() {
+    for (int reg = R_R0; reg <= R_R7; ++reg)
+        printf("R%d x%04X%s", reg, machine.registers[reg], reg == R_R7 ? "\n" : "  ");
+    uint16_t flag = machine.read_cond_flag();
+    printf("PC x%04X  COND %c  #%llu\n", machine.registers[R_PC],
+        flag == FL_NEG ? 'N' : (flag == FL_ZRO ? 'Z' : 'P'), (unsigned long long)count);
+}
+
+// LC-3 style hex (x3000) or a plain number
+uint16_t parse_address(const char* text) {
+    if (*text == 'x' || *text == 'X')
+        return (uint16_t)strtoul(text + 1, nullptr, 16);
+    return (uint16_t)strtoul(text, nullptr, 0);
+}
+
+void ReverseDebugger::command_loop() {
+    show_position();
+    char line[256];
+    while (printf("(lc3db) "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
+        char command[32] = "";
+        char argument[64] = "";
+        char argument2[64] = "";
+        if (sscanf(line, "%31s %63s %63s", command, argument, argument2) < 1)
+            continue;
+        uint64_t steps = *argument ? strtoull(argument, nullptr, 10) : 1;
+        string name = command;
+
+        if (name == "s" || name == "step") {
+            run_forward(steps, true, true);
+        }
+        else if (name == "rs" || name == "reverse-step") {
+            step_back(steps);
+        }
+        else if (name == "c" || name == "continue") {
+            // only checkpoints, the undo log is built when going back into an interval
+            run_forward(UINT64_MAX, true, false);
+        }
+        else if (name == "rc" || name == "reverse-continue") {
+            reverse_continue();
+        }
+        else if (name == "goto" && *argument) {
+            go_to(strtoull(argument, nullptr, 10));
+        }
+        else if ((name == "b" || name == "break") && *argument) {
+            breakpoints[parse_address(argument)] = 1;
+            continue;
+        }
+        else if ((name == "d" || name == "delete") && *argument) {
+            breakpoints[parse_address(argument)] = 0;
+            continue;
+        }
+        else if ((name == "lw" || name == "last-write") && *argument) {
+            last_write(parse_address(argument));
+            continue;
+        }
+        else if (name == "r" || name == "regs") {
+            show_registers();
+            continue;
+        }
+        else if (name == "x" && *argument) {
+            uint16_t address = parse_address(argument);
+            int words = *argument2 ? atoi(argument2) : 1;
+            for (int i = 0; i < words; ++i, ++address)
+                printf("x%04X: x%04X  %s\n", address, machine.memory[address], disassemble(address, machine.memory[address]).c_str());
+            continue;
+        }
+        else if (name == "info") {
+            size_t page_words = 0;
+            for (const Checkpoint& checkpoint : checkpoints)
+                page_words += checkpoint.pages.size();
+            printf("#%llu, %zu checkpoints (%zu KB of pages), %zu undo entries\n", (unsigned long long)count,
+                checkpoints.size(), page_words * sizeof(uint16_t) / 1024, undo.size());
+            continue;
+        }
+        else if (name == "q" || name == "quit") {
+            break;
+        }
+        else {
+            printf("Commands: s|step [n], rs|reverse-step [n], c|continue, rc|reverse-continue, goto <count>,\n"
+                   "          b|break <addr>, d|delete <addr>, lw|last-write <addr>, r|regs, x <addr> [n], info, q|quit\n");
+            continue;
+        }
+        io.output_flush();
+        show_position();
+    }
+}
+
+#pragma endregion Reverse debugger
+
+#pragma region Execution trace
+
+// --trace logs every executed instruction into a binary ring buffer file, --trace-dump turns
+// the file into text:
+//
+//   ./lc3 --trace run.trace [--trace-size N] [options] <image-file>
+//   ./lc3 --trace-dump run.trace [last-N] > run.txt
+//
+// The file is a TraceHeader followed by capacity fixed size records, the record of step n is
+// at n % capacity, so the file holds the last capacity steps of a run of any length. The file
+// is mapped, logging a step is a few stores into the page cache, no formatting or syscall.
+// The header's count is updated every TRACE_SYNC_STEPS steps and at the end, so the file can be
+// read (or followed) while the program runs. Records are little-endian, the fields a step doesn't
+// use are 0, which leaves lots of repetition for a general purpose compressor (zstd, xz).
+
+const char TRACE_MAGIC[8] = "LC3TRCE";
+const uint32_t TRACE_VERSION = 1;
+const uint64_t TRACE_SYNC_STEPS = 1 << 16;
+
+const uint8_t TRACE_REGISTER = 1 << 0; // reg was written, reg_value is its new value
+const uint8_t TRACE_MEMORY = 1 << 1; // address was stored to, value is the word stored
+const uint8_t TRACE_R7 = 1 << 2; // R7 was written as well, to the return address pc + 1 (GETC/IN, reg is R0)
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity; // records in the ring
+    uint64_t count; // steps logged so far
+};
+
+struct TraceRecord {
+    uint16_t pc;
+    uint16_t instruction;
+    uint16_t reg_value;
+    uint16_t address;
+    uint16_t value;
+    uint8_t reg;
+    uint8_t flags;
+};
+
+// Hooks of run_instrumented which log the steps
+class TraceHooks {
+public:
+    explicit TraceHooks(const LC3Machine& machine) : machine(machine) {}
+    ~TraceHooks();
+
+    // creates the file with room for capacity records, false if it can't
+    bool open(const char* path, uint64_t capacity);
+
+    void before(uint16_t pc, uint16_t instruction) {
+        // what the step is about to write (see make_undo_entry), the new values are read after it ran
+        UndoEntry entry = make_undo_entry(machine, pc, instruction);
+        uint16_t opcode = instruction >> 12;
+        Destination destination = OPCODES[opcode].destination;
+        bool reads_char = opcode == OP_TRAP && ((instruction & 0xFF) == TRAP_GETC || (instruction & 0xFF) == TRAP_IN);
+        record = &records[index];
+        record->pc = pc;
+        record->instruction = instruction;
+        record->reg = reads_char ? (uint8_t)R_R0 : (destination == DEST_R7 ? (uint8_t)R_R7 : entry.reg);
+        record->flags = (destination != DEST_NONE ? TRACE_REGISTER : 0) | (entry.flags & UNDO_MEMORY ? TRACE_MEMORY : 0)
+            | (reads_char ? TRACE_R7 : 0);
+        record->address = record->flags & TRACE_MEMORY ? entry.address : 0;
+    }
+
+    void after(uint16_t, uint16_t, uint16_t) {
+        record->reg_value = record->flags & TRACE_REGISTER ? machine.registers[record->reg] : 0;
+        record->value = record->flags & TRACE_MEMORY ? machine.memory[record->address] : 0;
+        if (!(record->flags & TRACE_REGISTER))
+            record->reg = 0;
+        if (++index == capacity)
+            index = 0;
+        if (++count % TRACE_SYNC_STEPS == 0)
+            header->count = count;
+    }
+
+    uint64_t count = 0;
+
+private:
+    const LC3Machine& machine;
+    TraceHeader* header = nullptr;
+    TraceRecord* records = nullptr;
+    TraceRecord* record = nullptr;
+    int fd = -1;
+    size_t mapped_size = 0;
+    uint64_t capacity = 0;
+    uint64_t index = 0;
+};
+
+bool TraceHooks::open(const char* path, uint64_t records_capacity) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    capacity = max<uint64_t>(records_capacity, 1);
+    mapped_size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+    void* mapped = MAP_FAILED;
+    if (ftruncate(fd, mapped_size) == 0)
+        mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    header = (TraceHeader*)mapped;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(TraceRecord);
+    header->capacity = capacity;
+    header->count = 0;
+    records = (TraceRecord*)(header + 1);
+    return true;
+}
+
+TraceHooks::~TraceHooks() {
+    if (!header)
+        return;
+    header->count = count;
+    // a run shorter than the ring doesn't need the rest of the file, its ring is just the steps
+    bool shrink = count && count < capacity;
+    if (shrink)
+        header->capacity = count;
+    munmap(header, mapped_size);
+    if (shrink && ftruncate(fd, sizeof(TraceHeader) + count * sizeof(TraceRecord)) != 0)
+        cout << "Failed to shrink the trace file" << endl;
+    close(fd);
+}
+
+// prints the last steps of a trace file (all of the ring if last is 0)
+int trace_dump(const char* path, uint64_t last) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TraceHeader)) {
+        cout << "Failed to read trace " << path << endl;
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cout << "Failed to map trace " << path << endl;
+        return 1;
+    }
+    const TraceHeader& header = *(const TraceHeader*)mapped;
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION
+        || header.record_size != sizeof(TraceRecord) || header.capacity == 0
+        || sizeof(TraceHeader) + header.capacity * sizeof(TraceRecord) > (uint64_t)info.st_size) {
+        cout << path << " isn't a trace of this version" << endl;
+        munmap(mapped, info.st_size);
+        return 1;
+    }
+    const TraceRecord* records = (const TraceRecord*)(&header + 1);
+    uint64_t first = header.count > header.capacity ? header.count - header.capacity : 0;
+    if (last && header.count - first > last)
+        first = header.count - last;
+
+    // one line per step, formatted into a buffer which is written when it fills up
+    const size_t LINE_MAX = 96;
+    vector<char> buffer(1 << 20);
+    char* out = buffer.data();
+    for (uint64_t step = first; step < header.count; ++step) {
+        const TraceRecord& record = records[step % header.capacity];
+        *out++ = '#';
+        out = put_unsigned(out, step);
+        *out++ = ' ';
+        out = put_hex(out, record.pc);
+        out = put_text(out, ": ");
+        char* text = out;
+        out = disassemble_to(out, record.pc, record.instruction);
+        // the effects are aligned
+        while (record.flags && out < text + 22)
+            *out++ = ' ';
+        if (record.flags & TRACE_REGISTER) {
+            out = put_register(put_text(out, "  "), record.reg);
+            out = put_hex(put_text(out, " = "), record.reg_value);
+        }
+        if (record.flags & TRACE_R7)
+            out = put_hex(put_text(out, "  R7 = "), (uint16_t)(record.pc + 1));
+        if (record.flags & TRACE_MEMORY) {
+            out = put_hex(put_text(out, "  ["), record.address);
+            out = put_hex(put_text(out, "] = "), record.value);
+        }
+        *out++ = '\n';
+        if (out + LINE_MAX > buffer.data() + buffer.size()) {
+            fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+            out = buffer.data();
+        }
+    }
+    fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+    munmap(mapped, info.st_size);
+    return 0;
+}
+
+#pragma endregion Execution trace
+
+#pragma region GDB remote stub
+
+// Server side of the GDB remote serial protocol, so a debugger (or any other RSP client)
+// can attach to the program:
+//
+//   ./lc3 --gdb /tmp/lc3.sock [--jit] [--input-file <file> | --input-string <keys>] <image-file>
+//   (gdb) target remote /tmp/lc3.sock
+//   (gdb) target remote | ./lc3 --gdb - <image-file>    # over stdin/stdout, the rest of the output goes to stderr
+//
+// The registers are the ones of enum Register in that order. LC-3 addresses words and the
+// protocol addresses bytes, so like other word addressed targets (eg AVR) the stub shows
+// word n as the bytes at 2n (low) and 2n + 1 (high) and PC as a byte address, which is why
+// it is 32 bits wide. Breakpoints (Z0/Z1) and watchpoints (Z2-Z4) are the ones of the
+// engines (see Breakpoints and watchpoints), continue runs the program on the decoded
+// engine (or the JIT) at full speed. A run without --gdb has none of this, and the stub
+// doesn't look at the connection while the program runs, so it can't be interrupted.
+
+const int GDB_SIGTRAP = 5;
+
+const char GDB_TARGET_XML[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.lc3.core\">"
+    "<reg name=\"r0\" bitsize=\"16\" type=\"int16\"/><reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r2\" bitsize=\"16\" type=\"int16\"/><reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r4\" bitsize=\"16\" type=\"int16\"/><reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>"
+    "<reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/><reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/><reg name=\"cond\" bitsize=\"16\" type=\"int16\"/>"
+    "</feature></target>";
+
+// hex digits of the size bytes of value, least significant first
+void append_hex_le(string& text, uint32_t value, int size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    for (int i = 0; i < size; ++i, value >>= 8) {
+        text += DIGITS[(value >> 4) & 0xF];
+        text += DIGITS[value & 0xF];
+    }
+}
+
+// true if text starts with at least count hex digits
+bool has_hex_digits(const char* text, size_t count) {
+    return strspn(text, "0123456789abcdefABCDEF") >= count;
+}
+
+// inverse of append_hex_le, text has to hold 2 * size digits (see has_hex_digits)
+uint32_t parse_hex_le(const char* text, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; ++i) {
+        char byte[3] = { text[2 * i], text[2 * i + 1], 0 };
+        value |= (uint32_t)strtoul(byte, nullptr, 16) << (8 * i);
+    }
+    return value;
+}
+
+class GdbStub {
+public:
+    GdbStub(LC3Machine& machine, int in, int out, bool use_jit) : machine(machine), in(in), out(out), use_jit(use_jit) {}
+
+    // serves the client until it detaches, kills the program or closes the connection.
+    // Returns false if the program should keep running (detach).
+    bool serve();
+
+private:
+    // false at the end of the connection
+    bool read_packet(string& packet);
+    void send_packet(const string& data);
+    int read_byte();
+
+    string handle(const string& packet);
+    string stop_reply() const;
+    string read_registers();
+    uint16_t read_register(int reg);
+    void write_register(int reg, uint32_t value);
+    string read_memory(uint32_t address, uint32_t size);
+    void write_memory(uint32_t address, uint32_t size, const char* data);
+    bool set_point(char type, uint32_t address, uint32_t size, bool enabled);
+    void resume(bool step);
+
+    LC3Machine& machine;
+    int in;
+    int out;
+    bool use_jit;
+    bool ack = true;
+    bool exited = false;
+    // the watchpoint which stopped the program, reported once with the next stop reply
+    bool stopped_at_watch = false;
+    uint16_t watch_address = 0;
+    bool watch_write = false;
+
+    char buffer[4096];
+    size_t buffer_size = 0;
+    size_t buffer_position = 0;
+};
+
+int GdbStub::read_byte() {
+    if (buffer_position == buffer_size) {
+        ssize_t bytes = read(in, buffer, sizeof(buffer));
+        if (bytes <= 0)
+            return EOF;
+        buffer_size = bytes;
+        buffer_position = 0;
+    }
+    return (unsigned char)buffer[buffer_position++];
+}
+
+bool GdbStub::read_packet(string& packet) {
+    while (true) {
+        // anything between packets (acks, a stray interrupt) is skipped
+        int ch;
+        while ((ch = read_byte()) != '$') {
+            if (ch == EOF)
+                return false;
+        }
+        packet.clear();
+        uint8_t sum = 0;
+        while ((ch = read_byte()) != '#') {
+            if (ch == EOF)
+                return false;
+            packet += (char)ch;
+            sum += ch;
+        }
+        int high = read_byte();
+        int low = read_byte();
+        if (low == EOF)
+            return false;
+        char digits[3] = { (char)high, (char)low, 0 };
+        bool valid = strtoul(digits, nullptr, 16) == sum;
+        if (ack && write(out, valid ? "+" : "-", 1) != 1)
+            return false;
+        if (valid || !ack)
+            return true;
+    }
+}
+
+void GdbStub::send_packet(const string& data) {
+    uint8_t sum = 0;
+    for (char ch : data)
+        sum += ch;
+    string packet = "$" + data + "#";
+    append_hex_le(packet, sum, 1);
+    // the ack isn't waited for, a client which asks for a resend doesn't get it
+    size_t written = 0;
+    while (written < packet.size()) {
+        ssize_t bytes = write(out, packet.data() + written, packet.size() - written);
+        if (bytes <= 0)
+            return;
+        written += bytes;
+    }
+}
+
+string GdbStub::stop_reply() const {
+    if (exited)
+        return "W00";
+    char reply[64];
+    if (stopped_at_watch)
+        snprintf(reply, sizeof(reply), "T%02x%s:%x;", GDB_SIGTRAP, watch_write ? "watch" : "rwatch", watch_address * 2);
+    else
+        snprintf(reply, sizeof(reply), "S%02x", GDB_SIGTRAP);
+    return reply;
+}
+
+uint16_t GdbStub::read_register(int reg) {
+    machine.sync_cond_register();
+    return machine.registers[reg];
+}
+
+string GdbStub::read_registers() {
+    string reply;
+    for (int reg = 0; reg < R_COUNT; ++reg) {
+        if (reg == R_PC)
+            append_hex_le(reply, machine.registers[R_PC] * 2, 4);
+        else
+            append_hex_le(reply, read_register(reg), 2);
+    }
+    return reply;
+}
+
+void GdbStub::write_register(int reg, uint32_t value) {
+    if (reg == R_PC)
+        machine.registers[R_PC] = value / 2;
+    else if (reg == R_COND)
+        machine.set_cond_flag(value & (FL_POS | FL_ZRO | FL_NEG));
+    else
+        machine.registers[reg] = value;
+}
+
+string GdbStub::read_memory(uint32_t address, uint32_t size) {
+    // the memory array itself, reading a device register through its device could change it
+    string reply;
+    for (uint32_t byte = address; byte < address + size; ++byte) {
+        uint16_t word = machine.memory[(uint16_t)(byte / 2)];
+        append_hex_le(reply, byte & 1 ? word >> 8 : word & 0xFF, 1);
+    }
+    return reply;
+}
+
+void GdbStub::write_memory(uint32_t address, uint32_t size, const char* data) {
+    for (uint32_t i = 0; i < size; ++i) {
+        uint32_t byte = address + i;
+        uint16_t word_address = byte / 2;
+        uint16_t value = parse_hex_le(data + 2 * i, 1);
+        uint16_t word = machine.memory[word_address];
+        word = byte & 1 ? (word & 0x00FF) | (value << 8) : (word & 0xFF00) | value;
+        // as a store to RAM, so the decoded slots and JIT blocks of the word are dropped
+        machine.ram_write(word, word_address);
+    }
+}
+
+// Z/z packets, type 0/1 is a breakpoint, 2/3/4 a write/read/access watchpoint
+bool GdbStub::set_point(char type, uint32_t address, uint32_t size, bool enabled) {
+    if (type == '0' || type == '1') {
+        machine.set_breakpoint(address / 2, enabled);
+        return true;
+    }
+    uint8_t flags = type == '2' ? WATCH_WRITE : (type == '3' ? WATCH_READ : (type == '4' ? WATCH_READ | WATCH_WRITE : 0));
+    if (!flags)
+        return false;
+    for (uint32_t word = address / 2; word <= (address + max<uint32_t>(size, 1) - 1) / 2; ++word) {
+        uint8_t current = machine.watchpoints ? machine.watchpoints->flags[(uint16_t)word] : 0;
+        machine.watch(word, enabled ? current | flags : current & ~flags);
+    }
+    return true;
+}
+
+void GdbStub::resume(bool step) {
+    stopped_at_watch = false;
+    if (exited)
+        return;
+    // the instruction under a breakpoint (or the one to step) runs outside of the engine
+    if (step || machine.is_breakpoint(machine.registers[R_PC])) {
+        uint16_t instruction = machine.memory_read(machine.registers[R_PC]++);
+        bool run = machine.eval_instruction(instruction, instruction >> 12, true);
+        if (!run || (machine.halt_requested && machine.paused != PAUSE_WATCHPOINT))
+            exited = true;
+    }
+    if (!step && !exited && !machine.paused) {
+        if (use_jit)
+            machine.run_jit();
+        else
+            machine.run_decoded();
+        if (!machine.paused)
+            exited = true;
+    }
+    if (machine.paused == PAUSE_WATCHPOINT) {
+        stopped_at_watch = true;
+        watch_address = machine.watchpoints->address;
+        watch_write = machine.watchpoints->write;
+    }
+    machine.paused = 0;
+    if (!exited)
+        machine.halt_requested = false;
+    machine.io->output_flush();
+}
+
+string GdbStub::handle(const string& packet) {
+    const char* args = packet.c_str() + 1;
+    switch (packet[0]) {
+        case '?':
+            return stop_reply();
+        case 'g':
+            return read_registers();
+        case 'G':
+        {
+            // every register in full, as 'g' sends them, before any of them is written
+            size_t digits = 0;
+            for (int reg = 0; reg < R_COUNT; ++reg)
+                digits += 2 * (reg == R_PC ? 4 : 2);
+            if (packet.size() - 1 != digits || !has_hex_digits(args, digits))
+                return "E01";
+            for (int reg = 0, offset = 0; reg < R_COUNT; ++reg) {
+                int size = reg == R_PC ? 4 : 2;
+                write_register(reg, parse_hex_le(args + offset, size));
+                offset += 2 * size;
+            }
+            return "OK";
+        }
+        case 'p':
+        {
+            int reg = strtoul(args, nullptr, 16);
+            if (reg >= R_COUNT)
+                return "E01";
+            string reply;
+            append_hex_le(reply, reg == R_PC ? machine.registers[R_PC] * 2 : read_register(reg), reg == R_PC ? 4 : 2);
+            return reply;
+        }
+        case 'P':
+        {
+            char* value;
+            int reg = strtoul(args, &value, 16);
+            if (reg >= R_COUNT || *value != '=' || !has_hex_digits(value + 1, 2 * (reg == R_PC ? 4 : 2)))
+                return "E01";
+            write_register(reg, parse_hex_le(value + 1, reg == R_PC ? 4 : 2));
+            return "OK";
+        }
+        case 'm':
+        case 'M':
+        {
+            char* end;
+            uint32_t address = strtoul(args, &end, 16);
+            uint32_t size = strtoul(end + 1, &end, 16);
+            if (size > sizeof(buffer) / 2)
+                return "E01";
+            if (packet[0] == 'm')
+                return read_memory(address, size);
+            if (*end != ':' || !has_hex_digits(end + 1, 2 * size))
+                return "E01";
+            write_memory(address, size, end + 1);
+            return "OK";
+        }
+        case 'c':
+        case 's':
+            if (*args)
+                machine.registers[R_PC] = strtoul(args, nullptr, 16) / 2;
+            resume(packet[0] == 's');
+            return stop_reply();
+        case 'Z':
+        case 'z':
+        {
+            // Zt,addr,kind, the address and kind in hex, within the memory
+            char* end;
+            if (packet.size() < 6 || packet[2] != ',' || !has_hex_digits(args + 2, 1))
+                return "E01";
+            uint32_t address = strtoul(args + 2, &end, 16);
+            if (*end != ',' || !has_hex_digits(end + 1, 1))
+                return "E01";
+            uint32_t size = strtoul(end + 1, &end, 16);
+            if (*end || address >= 2 * MEMORY_MAX || size > 2 * MEMORY_MAX - address)
+                return "E01";
+            return set_point(packet[1], address, size, packet[0] == 'Z') ? "OK" : "";
+        }
+        case 'H':
+            return "OK"; // a single thread
+        case 'T':
+            return "OK";
+        default:
+            break;
+    }
+    if (packet.compare(0, 10, "qSupported") == 0)
+        return "PacketSize=2000;qXfer:features:read+;QStartNoAckMode+";
+    if (packet == "QStartNoAckMode") {
+        // the OK is still acked
+        send_packet("OK");
+        ack = false;
+        return string();
+    }
+    if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0) {
+        char* end;
+        size_t offset = strtoul(packet.c_str() + 31, &end, 16);
+        size_t size = strtoul(end + 1, nullptr, 16);
+        size_t total = sizeof(GDB_TARGET_XML) - 1;
+        if (offset >= total)
+            return "l";
+        size = min(size, total - offset);
+        return (offset + size == total ? "l" : "m") + string(GDB_TARGET_XML + offset, size);
+    }
+    if (packet == "qAttached")
+        return "1";
+    if (packet == "qC")
+        return "QC1";
+    if (packet == "qfThreadInfo")
+        return "m1";
+    if (packet == "qsThreadInfo")
+        return "l";
+    return string(); // not supported
+}
+
+bool GdbStub::serve() {
+    string packet;
+    while (read_packet(packet)) {
+        if (packet.empty())
+            continue;
+        if (packet[0] == 'k')
+            return true;
+        if (packet[0] == 'D') {
+            send_packet("OK");
+            return exited;
+        }
+        string reply = handle(packet);
+        if (packet != "QStartNoAckMode")
+            send_packet(reply);
+    }
+    return true;
+}
+
+// --gdb: path of a Unix socket to wait for the client on, or - for stdin/stdout.
+// Returns the exit code of the process.
+int gdb_main(LC3Machine& machine, const char* path, int stdio_out, bool use_jit) {
+    int connection = -1;
+    int in = 0;
+    int out = stdio_out;
+    if (strcmp(path, "-") != 0) {
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (server < 0 || strlen(path) >= sizeof(address.sun_path)) {
+            cout << "Can't create the GDB socket " << path << endl;
+            return 1;
+        }
+        strcpy(address.sun_path, path);
+        unlink(path);
+        if (bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, 1) != 0) {
+            cout << "Can't listen on the GDB socket " << path << ": " << strerror(errno) << endl;
+            close(server);
+            return 1;
+        }
+        cout << "Waiting for GDB on " << path << endl;
+        connection = accept(server, nullptr, nullptr);
+        close(server);
+        unlink(path);
+        if (connection < 0) {
+            cout << "GDB connection failed: " << strerror(errno) << endl;
+            return 1;
+        }
+        in = out = connection;
+    }
+
+    GdbStub stub(machine, in, out, use_jit);
+    bool done = stub.serve();
+    if (connection >= 0)
+        close(connection);
+    if (!done) {
+        // detached, the program runs on (the client removes its breakpoints before)
+        run_with_breakpoints(machine, use_jit);
+        machine.io->output_flush();
+    }
+    return 0;
+}
+
+#pragma endregion GDB remote stub
+
+int main(int argc, const char* argv[]) {
+    // the machine attached to the terminal
+    static LC3Machine machine(&terminal);
+
+    const char* image_path = nullptr;
+    bool use_jit = false;
+    bool pair_histogram = false;
+    bool profile = false;
+    size_t top = 20;
+    const char* input_file = nullptr;
+    const char* input_string = nullptr;
+    const char* snapshot_path = nullptr;
+    uint64_t snapshot_at = 0;
+    const char* restore_path = nullptr;
+    const char* record_path = nullptr;
+    const char* replay_path = nullptr;
+    bool debug = false;
+    uint64_t checkpoint_interval = 1000000;
+    vector<uint16_t> break_addresses;
+    vector<pair<uint16_t, uint8_t>> watch_addresses;
+    const char* gdb_path = nullptr;
+    const char* trace_path = nullptr;
+    uint64_t trace_size = 1 << 22;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = true;
+        }
+        else if (strcmp(argv[i], "--pair-histogram") == 0) {
+            pair_histogram = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        }
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--input-file") == 0 && i + 1 < argc) {
+            input_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--input-string") == 0 && i + 1 < argc) {
+            input_string = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 2 < argc) {
+            snapshot_at = strtoull(argv[i + 1], nullptr, 10);
+            snapshot_path = argv[i + 2];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--debug") == 0) {
+            debug = true;
+        }
+        else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_interval = max<uint64_t>(1, strtoull(argv[++i], nullptr, 10));
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) {
+            trace_size = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--trace-dump") == 0) {
+            if (i + 1 >= argc) {
+                cout << "Usage: lc3 --trace-dump <trace-file> [last-N]\n";
+                exit(2);
+            }
+            return trace_dump(argv[i + 1], i + 2 < argc ? strtoull(argv[i + 2], nullptr, 10) : 0);
+        }
+        else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+            gdb_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+            break_addresses.push_back(parse_address(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch_addresses.push_back({ parse_address(argv[++i]), WATCH_WRITE });
+        }
+        else if (strcmp(argv[i], "--rwatch") == 0 && i + 1 < argc) {
+            watch_addresses.push_back({ parse_address(argv[++i]), WATCH_READ });
+        }
+        else if (strcmp(argv[i], "--translate") == 0) {
+            if (i + 2 >= argc) {
+                cout << "Usage: lc3 --translate <image-file> <output-file>\n";
+                exit(2);
+            }
+            if (!translate_image(machine, argv[i + 1], argv[i + 2])) {
+                cout << "LC3 image translation failed\n";
+                exit(1);
+            }
+            return 0;
+        }
+        else if (strcmp(argv[i], "--assemble") == 0) {
+            if (i + 2 >= argc) {
+                cout << "Usage: lc3 --assemble <source-file> <image-file>\n";
+                exit(2);
+            }
+            vector<uint16_t> image;
+            if (!assemble_file(argv[i + 1], image))
+                exit(1);
+            if (!write_image_file(argv[i + 2], image)) {
+                cout << "Failed to write " << argv[i + 2] << endl;
+                exit(1);
+            }
+            printf("Assembled %zu words at x%04X into %s\n", image.size() - 1, image[0], argv[i + 2]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--batch") == 0) {
+            return batch_main(argc, argv, i + 1, use_jit);
+        }
+        else if (strcmp(argv[i], "--fuzz") == 0) {
+            return fuzz_main(argc, argv, i + 1);
+        }
+        else if (strcmp(argv[i], "--bench") == 0) {
+            // the remaining arguments are options of the suite or images
+            vector<const char*> images;
+            int runs = 5;
+            for (++i; i < argc; ++i) {
+                if (strcmp(argv[i], "--jit") == 0)
+                    use_jit = true;
+                else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+                    runs = atoi(argv[++i]);
+                else
+                    images.push_back(argv[i]);
+            }
+            return bench_suite(images, runs, use_jit);
+        }
+        else if (strcmp(argv[i], "--bench-load") == 0) {
+            if (i + 1 >= argc) {
+                cout << "Usage: lc3 --bench-load <image-file> [iterations]\n";
+                exit(2);
+            }
+            return bench_load(argv[i + 1], i + 2 < argc ? atoi(argv[i + 2]) : 10000);
+        }
+        else {
+            image_path = argv[i];
+        }
+    }
+
+    // --gdb -: the protocol has stdout to itself, everything else printed goes to stderr
+    int gdb_out = STDOUT_FILENO;
+    if (gdb_path && strcmp(gdb_path, "-") == 0) {
+        gdb_out = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+#ifdef LC3_AOT
+    // the image is built into the binary
+    if (image_path)
+        cout << "Image is built in, ignoring " << image_path << endl;
+    cout << "Loaded translated image, size: " << aot_load_image(machine) * 2 << " Bytes" << endl;
+#else
+    if (restore_path) {
+        // continue a snapshot instead of starting an image
+        if (!machine.restore_snapshot(restore_path)) {
+            cout << "LC3 snapshot restore failed\n";
+            exit(1);
+        }
+        printf("Restored snapshot %s, PC x%04X\n", restore_path, machine.registers[R_PC]);
+    }
+    else {
+        if (!image_path) {
+            cout << "Usage: lc3 [--jit | --profile | --pair-histogram] [--top N] [--input-file <file> | --input-string <keys>]\n";
+            cout << "           [--record <log-file> | --replay <log-file>] [--snapshot-at N <snapshot-file>]\n";
+            cout << "           [--break <addr>]... [--watch <addr>]... [--rwatch <addr>]... [--trace <trace-file> [--trace-size N]]\n";
+            cout << "           <image-file | source-file.asm> | --restore <snapshot-file>\n";
+            cout << "       lc3 --debug [--checkpoint-every N] [--input-file <file> | --input-string <keys>] <image-file>\n";
+            cout << "       lc3 --gdb <socket-path | -> [--jit] [--input-file <file> | --input-string <keys>] <image-file>\n";
+            cout << "       lc3 --translate <image-file> <output-file>\n";
+            cout << "       lc3 --assemble <source-file> <image-file>\n";
+            cout << "       lc3 --trace-dump <trace-file> [last-N]\n";
+            cout << "       lc3 --batch [--jit] [--threads N] [--out DIR] [--max-instructions N] [--restore] <image-file>... [--inputs <input-file>...]\n";
+            cout << "       lc3 --bench [--jit] [--runs N] [image-file...]\n";
+            cout << "       lc3 --fuzz [--runs N] [--seconds S] [--corpus DIR] [--restore] <image-file | snapshot-file>\n";
+            exit(2); 
+        }
+        cout << "Image path: " << image_path << endl;
+        int image_words;
+        size_t path_size = strlen(image_path);
+        if (path_size > 4 && strcasecmp(image_path + path_size - 4, ".asm") == 0) {
+            // source, assembled in memory
+            vector<uint16_t> image;
+            if (!assemble_file(image_path, image))
+                exit(1);
+            image_words = machine.load_words(image);
+        }
+        else {
+            image_words = machine.load_image(image_path);
+        }
+        if (image_words < 0) {
+            cout << "LC3 image load failed\n";
+            exit(1);
+        }
+        cout << "Loaded image file into memory, size: " << image_words * 2 << " Bytes" << endl;
+    }
+#endif
+#if LC3_JIT_SUPPORTED
+    if (use_jit && !machine.jit_init()) {
+        cout << "JIT init failed, falling back to the interpreter\n";
+        use_jit = false;
+    }
+#else
+    if (use_jit) {
+        cout << "JIT is only supported on x86-64 Linux, falling back to the interpreter\n";
+        use_jit = false;
+    }
+#endif
+
+    // headless run, the keyboard is fed from the script (file first, then the string)
+    bool scripted = input_file || input_string;
+    string script;
+    if (input_file && !read_whole_file(input_file, script)) {
+        cout << "Failed to read input file " << input_file << endl;
+        exit(1);
+    }
+    if (input_string)
+        script += input_string;
+    ScriptIO script_io(script.data(), script.size(), stdout);
+
+    // --replay is headless too, the keyboard is the recorded log
+    ReplayIO replay_io(stdout);
+    if (replay_path && !replay_io.load(replay_path)) {
+        cout << "Failed to read input recording " << replay_path << endl;
+        exit(1);
+    }
+    // --debug: the keyboard is the script, stdin has the debugger commands
+    DebugIO debug_io(script, false);
+
+    // --record logs the terminal input, a headless run has nothing to record
+    FILE* record_log = nullptr;
+    RecordIO* record_io = nullptr;
+    if (record_path && (scripted || replay_path || debug || gdb_path)) {
+        cout << "Only terminal input can be recorded, ignoring --record" << endl;
+    }
+    else if (record_path) {
+        record_log = fopen(record_path, "wb");
+        if (!record_log) {
+            cout << "Failed to create input recording " << record_path << endl;
+            exit(1);
+        }
+        record_io = new RecordIO(&terminal, record_log);
+    }
+
+    if (debug) {
+        machine.io = &debug_io;
+        scripted = true;
+    }
+    else if (replay_path) {
+        machine.io = &replay_io;
+        scripted = true;
+    }
+    else if (gdb_path) {
+        // the keyboard is the script, the terminal stays with the debugger
+        machine.io = &script_io;
+        scripted = true;
+    }
+    else if (scripted) {
+        machine.io = &script_io;
+    }
+    else {
+        if (record_io)
+            machine.io = record_io;
+        // register the interrupt handler
+        signal(SIGINT, interrupt_handler);
+        // prepare the terminal
+        terminal.disable_input_buffering();
+        start_input_thread();
+    }
+
+    if (!restore_path) {
+        machine.set_cond_flag(FL_ZRO); // reset the condition flag
+        machine.registers[R_PC] = 0x3000; // start at the default 0x3000 mem addr
+    }
+
+    if (debug) {
+        ReverseDebugger debugger(machine, debug_io, script, checkpoint_interval);
+        debugger.command_loop();
+        return 0;
+    }
+    if (gdb_path)
+        return gdb_main(machine, gdb_path, gdb_out, use_jit);
+
+    if (snapshot_path) {
+        // run up to the snapshot point, save and stop there
+        uint64_t executed = run_for(machine, snapshot_at);
+        machine.io->output_flush();
+        if (!scripted)
+            terminal.restore_input_buffering();
+        if (executed < snapshot_at) {
+            cout << "Program halted after " << executed << " instructions, no snapshot saved" << endl;
+            return 1;
+        }
+        if (!machine.save_snapshot(snapshot_path)) {
+            cout << "Failed to write snapshot " << snapshot_path << endl;
+            return 1;
+        }
+        printf("Saved snapshot %s after %llu instructions, PC x%04X\n", snapshot_path,
+            (unsigned long long)executed, machine.registers[R_PC]);
+        return 0;
+    }
+
+    cout << "Booting up LC-3 Virtual Machine..." << endl;
+#if defined(LC3_AOT)
+    run_aot(machine);
+#else
+    if (trace_path) {
+        TraceHooks hooks(machine);
+        if (!hooks.open(trace_path, trace_size)) {
+            cout << "Failed to create trace " << trace_path << endl;
+            exit(1);
+        }
+        run_instrumented(machine, hooks);
+        machine.io->output_flush();
+        printf("Traced %llu steps to %s\n", (unsigned long long)hooks.count, trace_path);
+    }
+    else if (profile) {
+        ProfileHooks hooks(machine.registers[R_PC]);
+        run_instrumented(machine, hooks);
+        machine.io->output_flush();
+        hooks.report(machine, top);
+    }
+    else if (pair_histogram) {
+        PairHistogramHooks hooks;
+        run_instrumented(machine, hooks);
+        machine.io->output_flush();
+        hooks.report(top);
+    }
+    else if (!break_addresses.empty() || !watch_addresses.empty()) {
+        for (uint16_t address : break_addresses)
+            machine.set_breakpoint(address, true);
+        // an address given twice is watched for both
+        for (const auto& watch : watch_addresses)
+            machine.watch(watch.first, watch.second | (machine.watchpoints ? machine.watchpoints->flags[watch.first] : 0));
+        run_with_breakpoints(machine, use_jit);
+    }
+    else if (use_jit)
+        machine.run_jit();
+    else
+        machine.run_decoded();
+#endif
+    machine.sync_cond_register();
+    machine.io->output_flush();
+
+    if (replay_path) {
+        // fewer events used than recorded means the run went a different way (eg another image)
+        cout << "Replayed " << replay_io.events_replayed() << " of " << replay_io.events_recorded()
+             << " input events" << endl;
+    }
+    else if (scripted) {
+        if (script_io.input_ended)
+            cout << "Reached the end of the scripted input" << endl;
+    }
+    else {
+        terminal.restore_input_buffering();
+        if (record_io) {
+            fclose(record_log);
+            cout << "Recorded " << record_io->events << " input events to " << record_path << endl;
+            delete record_io;
+        }
+    }
     return 0;
 }
\ No newline at end of file
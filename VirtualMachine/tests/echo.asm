@@ -0,0 +1,32 @@
+; Scripted input through the traps: echoes every character read with GETC, upper cased,
+; and counts the lines. GETC halts the program once the input is consumed.
+        .ORIG x3000
+        AND R3, R3, #0          ; no. of lines
+LOOP    GETC
+        LD R1, NEGA
+        ADD R1, R0, R1
+        BRn PRINT               ; below 'a'
+        LD R1, NEGZ
+        ADD R1, R0, R1
+        BRp PRINT               ; above 'z'
+        LD R1, UPPER
+        ADD R0, R0, R1
+PRINT   OUT
+        ADD R1, R0, #-10
+        BRnp LOOP
+        ADD R3, R3, #1
+        LEA R0, LINES
+        PUTS
+        LD R0, DIGIT
+        ADD R0, R0, R3
+        OUT
+        LD R0, NEWLINE
+        OUT
+        BRnzp LOOP
+NEGA    .FILL #-97
+NEGZ    .FILL #-122
+UPPER   .FILL #-32
+DIGIT   .FILL #48
+NEWLINE .FILL #10
+LINES   .STRINGZ "lines: "
+        .END
@@ -0,0 +1,12 @@
+; Scripted input through the device registers: echoes the input by polling KBSR and reading
+; KBDR, without the traps. The KBSR poll past the end of the input halts the program, the
+; poll loop is hot enough to be compiled by the JIT.
+        .ORIG x3000
+LOOP    LDI R0, KBSRP
+        BRzp LOOP
+        LDI R0, KBDRP
+        OUT
+        BRnzp LOOP
+KBSRP   .FILL xFE00
+KBDRP   .FILL xFE02
+        .END
@@ -0,0 +1,251 @@
+#!/bin/bash
+# Differential tests: runs the bench programs and the scripted-input programs of tests/ on
+# every engine and checks that they all give the output of the default (decoded) engine.
+# The built-in assembler has to reproduce the committed .obj files.
+#
+#   tests/run_tests.sh            (CXX and CXXFLAGS override the compiler and its flags)
+#
+# Builds the VM twice (computed goto and LC3_SWITCH_DISPATCH) into a temporary directory.
+# Every run has a timeout, so an engine which doesn't stop fails instead of hanging.
+
+cd "$(dirname "$0")/.." || exit 1
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--O2 -Wall -Wno-unknown-pragmas}
+TIMEOUT=${TIMEOUT:-30}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+echo "Building"
+$CXX $CXXFLAGS -pthread lc3_vm.cpp -o "$tmp/lc3" || exit 1
+$CXX $CXXFLAGS -pthread -DLC3_SWITCH_DISPATCH lc3_vm.cpp -o "$tmp/lc3_switch" || exit 1
+
+failed=0
+passed=0
+
+fail() {
+    echo "FAIL $1"
+    failed=$((failed + 1))
+}
+
+# the program output of a direct run, without the lines the VM prints before booting
+# and at the end of the scripted input
+program_output() {
+    tail -n +4 "$1" | sed -z 's/Reached the end of the scripted input\n$//'
+}
+
+# run <name> <expected-file> <command>...: the program output of the command has to be the
+# expected one
+run() {
+    local name=$1 expected=$2
+    shift 2
+    timeout "$TIMEOUT" "$@" > "$tmp/out" 2>&1
+    local status=$?
+    if [ $status -eq 124 ]; then
+        fail "$name: timed out"
+        return
+    fi
+    program_output "$tmp/out" > "$tmp/actual"
+    if ! cmp -s "$expected" "$tmp/actual"; then
+        fail "$name: output differs"
+        diff "$expected" "$tmp/actual" | head -5
+        return
+    fi
+    passed=$((passed + 1))
+}
+
+# batch <name> <expected-file> <image> <input-file> <options>...: same for a batch job
+batch() {
+    local name=$1 expected=$2 image=$3 input=$4
+    shift 4
+    rm -rf "$tmp/batch"
+    if ! timeout "$TIMEOUT" "$tmp/lc3" --batch --out "$tmp/batch" "$@" "$image" --inputs "$input" > /dev/null; then
+        fail "$name: batch failed or timed out"
+        return
+    fi
+    if ! cmp -s "$expected" "$tmp/batch/0.out"; then
+        fail "$name: output differs"
+        diff "$expected" "$tmp/batch/0.out" | head -5
+        return
+    fi
+    passed=$((passed + 1))
+}
+
+# check_direct <image> <input> <vm-option>...: the image with the input and the options on the
+# engines of a direct run, the decoded loop's output is left in $tmp/expected
+check_direct() {
+    local image=$1 input=$2 name
+    shift 2
+    name="$(basename "$image")${*:+ $*}"
+    printf '%s' "$input" > "$tmp/input"
+    timeout "$TIMEOUT" "$tmp/lc3" "$@" --input-file "$tmp/input" "$image" > "$tmp/out" 2>&1
+    if [ $? -eq 124 ]; then
+        fail "$name: timed out"
+        return 1
+    fi
+    program_output "$tmp/out" > "$tmp/expected"
+
+    run "$name --jit" "$tmp/expected" "$tmp/lc3" --jit "$@" --input-file "$tmp/input" "$image"
+    run "$name switch" "$tmp/expected" "$tmp/lc3_switch" "$@" --input-file "$tmp/input" "$image"
+}
+
+# check <image> <input>: the image with the input on every engine, the decoded loop's output
+# is the expected one
+check() {
+    local image=$1 name
+    name=$(basename "$image")
+    check_direct "$image" "$2" || return
+    batch "$name --batch" "$tmp/expected" "$image" "$tmp/input"
+    batch "$name --batch --jit" "$tmp/expected" "$image" "$tmp/input" --jit
+    batch "$name --batch --lockstep" "$tmp/expected" "$image" "$tmp/input" --lockstep
+    batch "$name --batch --lockstep --jit" "$tmp/expected" "$image" "$tmp/input" --lockstep --jit
+}
+
+# check_lockstep <image> <input>...: one batch job per input, run as the lanes of a --lockstep
+# group, every job has to give the output of its direct run
+check_lockstep() {
+    local image=$1 name job options
+    shift
+    name=$(basename "$image")
+    local inputs=()
+    rm -rf "$tmp/jobs"
+    mkdir "$tmp/jobs"
+    for job in $(seq 0 $(($# - 1))); do
+        printf '%s' "${@:$((job + 1)):1}" > "$tmp/jobs/$job"
+        inputs+=("$tmp/jobs/$job")
+        timeout "$TIMEOUT" "$tmp/lc3" --input-file "$tmp/jobs/$job" "$image" > "$tmp/out" 2>&1
+        program_output "$tmp/out" > "$tmp/jobs/$job.expected"
+    done
+    for options in "--lockstep" "--lockstep --jit"; do
+        rm -rf "$tmp/batch"
+        # shellcheck disable=SC2086
+        if ! timeout "$TIMEOUT" "$tmp/lc3" --batch --out "$tmp/batch" $options "$image" --inputs "${inputs[@]}" > /dev/null; then
+            fail "$name $# jobs --batch $options: batch failed or timed out"
+            continue
+        fi
+        for job in $(seq 0 $(($# - 1))); do
+            if ! cmp -s "$tmp/jobs/$job.expected" "$tmp/batch/$job.out"; then
+                fail "$name $# jobs --batch $options: output of job $job differs"
+                continue 2
+            fi
+        done
+        passed=$((passed + 1))
+    done
+}
+
+# check_budget <image> <instructions> <input>...: the jobs with --max-instructions as lanes of
+# a --lockstep group, the status and output of every job have to be the ones of a normal batch
+check_budget() {
+    local image=$1 budget=$2 name job options
+    shift 2
+    name="$(basename "$image") --max-instructions $budget"
+    local inputs=()
+    rm -rf "$tmp/jobs" "$tmp/plain"
+    mkdir "$tmp/jobs"
+    for job in $(seq 0 $(($# - 1))); do
+        printf '%s' "${@:$((job + 1)):1}" > "$tmp/jobs/$job"
+        inputs+=("$tmp/jobs/$job")
+    done
+    timeout "$TIMEOUT" "$tmp/lc3" --batch --out "$tmp/plain" --max-instructions "$budget" "$image" --inputs "${inputs[@]}" > /dev/null
+    for options in "--lockstep" "--lockstep --jit"; do
+        rm -rf "$tmp/batch"
+        # shellcheck disable=SC2086
+        timeout "$TIMEOUT" "$tmp/lc3" --batch --out "$tmp/batch" --max-instructions "$budget" $options "$image" --inputs "${inputs[@]}" > /dev/null
+        if [ $? -eq 124 ]; then
+            fail "$name $options: timed out"
+            continue
+        fi
+        if [ "$(cut -f4 "$tmp/plain/stats.tsv")" != "$(cut -f4 "$tmp/batch/stats.tsv")" ]; then
+            fail "$name $options: status differs"
+            continue
+        fi
+        for job in $(seq 0 $(($# - 1))); do
+            if ! cmp -s "$tmp/plain/$job.out" "$tmp/batch/$job.out"; then
+                fail "$name $options: output of job $job differs"
+                continue 2
+            fi
+        done
+        passed=$((passed + 1))
+    done
+}
+
+# check_status <name> <image> <status> <options>...: the status of the batch job in stats.tsv
+check_status() {
+    local name=$1 image=$2 expected=$3 status
+    shift 3
+    rm -rf "$tmp/batch"
+    timeout "$TIMEOUT" "$tmp/lc3" --batch --out "$tmp/batch" "$@" "$image" > /dev/null
+    if [ $? -eq 124 ]; then
+        fail "$name: timed out"
+        return
+    fi
+    status=$(awk -F'\t' 'NR == 2 { print $4 }' "$tmp/batch/stats.tsv")
+    if [ "$status" != "$expected" ]; then
+        fail "$name: status $status, expected $expected"
+        return
+    fi
+    passed=$((passed + 1))
+}
+
+echo "Running"
+# the built-in assembler reproduces the committed images byte for byte
+for source in tests/*.asm assets/bench/*.asm; do
+    if ! "$tmp/lc3" --assemble "$source" "$tmp/assembled.obj" > /dev/null; then
+        fail "$source: doesn't assemble"
+    elif ! cmp -s "${source%.asm}.obj" "$tmp/assembled.obj"; then
+        fail "$source: image differs from ${source%.asm}.obj"
+    else
+        passed=$((passed + 1))
+    fi
+done
+
+for image in assets/bench/*.obj; do
+    check "$image" ""
+done
+
+check tests/echo.obj $'hello\nscripted world\n'
+check tests/echo.obj "no newline at the end"
+check tests/poll.obj "abcdefghijklmnopqrstuvwxyz"
+# images with only the origin, the program runs into the keyboard page and its KBSR poll halts it
+printf '\x00\x00' > "$tmp/origin0.obj"
+printf '\x30\x00' > "$tmp/origin3000.obj"
+check "$tmp/origin0.obj" ""
+check "$tmp/origin3000.obj" ""
+# a source file runs directly, assembled in memory
+printf '        .ORIG x0000\n        .END\n' > "$tmp/origin0.asm"
+check_direct "$tmp/origin0.asm" ""
+check_direct tests/echo.asm "hello"
+check assets/2048.obj "nwasdwasdwasdddssaaww"
+
+# lanes which part (see spin.asm), the spinning ones run at the lowest PC
+check_lockstep tests/spin.obj "0" "9" "0" "3" "0" "0"
+check_lockstep tests/spin.obj "9" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0" "0"
+check_lockstep assets/2048.obj "nwasdwasd" "nddddssss" "nsasasasa" "nwwwwaaaa" "y" "nwdsawdsa"
+
+# breakpoints, one on a superinstruction's 2nd word, and watchpoints (see watch.asm), an
+# instruction fetch is a read too
+check_direct tests/watch.obj "" --break x3004 --break x300D
+check_direct tests/watch.obj "" --rwatch x3003
+# the LDR of a read-modify-write superinstruction
+check_direct tests/watch.obj "" --rwatch x3100
+# a late element of the SUM loop, by then the loop is a compiled block under --jit
+check_direct tests/watch.obj "" --rwatch x3160
+check_direct tests/watch.obj "" --watch x3100
+check_direct assets/2048.obj "nwasd" --break x3010 --watch x4010
+
+# a job which never halts (BRnzp #-1 at x3000) is stopped by its instruction budget
+printf '\x30\x00\x0f\xff' > "$tmp/forever.obj"
+for options in "" "--jit" "--lockstep" "--lockstep --jit"; do
+    # shellcheck disable=SC2086
+    check_status "forever --max-instructions $options" "$tmp/forever.obj" timeout --max-instructions 10000000 $options
+    # shellcheck disable=SC2086
+    check_status "loop.obj --max-instructions $options" assets/bench/loop.obj halted --max-instructions 100000000 $options
+done
+
+# budgets which run out in lockstep, in the split lanes and mid-output
+check_budget tests/spin.obj 1000000 "0" "9" "0" "3" "0" "2"
+check_budget tests/spin.obj 200013 "1" "0" "1" "1"
+check_budget assets/2048.obj 50013 "nwasdwasd" "nddddssss" "nsasasasa" "nwwwwaaaa" "y" "nwdsawdsa"
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
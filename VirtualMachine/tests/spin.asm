@@ -0,0 +1,23 @@
+; Lanes which part for long, for the --lockstep checks of run_tests.sh. The 1st input
+; character c makes the program spin (c - '0') * 64K iterations in the loop at its lowest
+; addresses before it prints, so the lanes which don't spin wait at higher addresses.
+        .ORIG x3000
+        BRnzp MAIN
+SPIN    AND R2, R2, #0
+INNER   ADD R2, R2, #-1
+        BRnp INNER
+        ADD R1, R1, #-1
+        BRp SPIN
+        RET
+MAIN    GETC
+        OUT
+        LD R1, NEGZERO
+        ADD R1, R0, R1
+        BRnz PRINT
+        JSR SPIN
+PRINT   LEA R0, DONE
+        PUTS
+        HALT
+NEGZERO .FILL #-48
+DONE    .STRINGZ " done\n"
+        .END
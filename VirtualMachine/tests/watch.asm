@@ -0,0 +1,35 @@
+; Loops over data on the page after the code, for the watchpoint checks of run_tests.sh:
+; a read-modify-write of a counter (a superinstruction in the decoded loop) and a sum over
+; an array, hot enough to be compiled by the JIT long before it reads the watched element.
+; COUNT is x3100, ARRAY starts at x3101.
+        .ORIG x3000
+        LD R1, COUNTP
+        AND R2, R2, #0
+        ADD R2, R2, #10
+COUNTER LDR R0, R1, #0
+        ADD R0, R0, #1
+        STR R0, R1, #0
+        ADD R2, R2, #-1
+        BRp COUNTER
+
+        LD R1, ARRAYP
+        LD R2, LENGTH
+        AND R3, R3, #0
+SUM     LDR R0, R1, #0
+        ADD R3, R3, R0
+        ADD R3, R3, #1
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp SUM
+
+        LEA R0, DONE
+        PUTS
+        HALT
+LENGTH  .FILL #100
+COUNTP  .FILL COUNT
+ARRAYP  .FILL ARRAY
+DONE    .STRINGZ "done\n"
+        .BLKW #227
+COUNT   .FILL #0
+ARRAY   .BLKW #100
+        .END